@@ -8,6 +8,8 @@
  * May not be used, modified, or copied without permission.
  */
 
+#include <stdint.h>
+
 /*
  * This is the default path where the driver will look for the
  * default tracefiles. You can override it at runtime with the -t flag.
@@ -58,9 +60,14 @@
 #define ALIGNMENT 8  
 
 /* 
- * Maximum heap size in bytes 
+ * Maximum heap size in bytes : address space reserved by mem_init, whose
+ * pages are only backed once the heap reaches them
  */
+#if UINTPTR_MAX > 0xffffffff
+#define MAX_HEAP ((size_t)64 << 30)  /* 64 GB */
+#else
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
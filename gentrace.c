@@ -0,0 +1,520 @@
+/*
+ * gentrace.c - Generates synthetic traces, in the .rep format or in the
+ *    binary format of trace.h
+ *
+ * Usage: gentrace [-b] [-S <seed>] [phase options] [-P phase options ...] <out>
+ *
+ * A trace is a sequence of phases, each replaying a model of a program
+ * for a number of requests:
+ *
+ *   -n <ops>     requests of the phase (default 1000000)
+ *   -s <dist>    request sizes in bytes (default pow:1.5:8:16384)
+ *   -l <dist>    lifetimes of the blocks, in requests (default exp:1000)
+ *   -g <pct>:<factor>:<count>
+ *                pct% of the blocks grow by factor with realloc, count
+ *                times over their life (default none)
+ *   -L <bytes>   bound of the live set : the blocks closest to their
+ *                death are freed early to stay under it (default none)
+ *   -P           ends the phase : the options that follow change the
+ *                model of the next one, which starts from the current one
+ *
+ * The distributions are
+ *
+ *   uni:<min>:<max>              uniform
+ *   exp:<mean>                   exponential
+ *   pow:<alpha>:<min>:<max>      power law of exponent alpha, truncated
+ *   bimodal:<a>:<b>:<pct>        a (pct% of the time) or b, each +-25%
+ *   hist:<file>                  histogram of "<value> <count>" lines
+ *
+ * The blocks still live at the end of the last phase are freed, so that
+ * the trace is balanced. The ids of freed blocks are reused, so that the
+ * driver's tables follow the live set rather than the number of requests.
+ * The header is written last, which needs a seekable output file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <math.h>
+
+#include "trace.h"
+
+#define MAXLINE 1024   /* max string size */
+#define MAX_PHASES 64  /* max phases of a trace */
+#define REP_FIELD 11   /* width of the .rep header fields, rewritten at the end */
+
+/* A distribution of sizes or lifetimes */
+typedef struct {
+    enum {UNIFORM, EXPONENTIAL, POWER, BIMODAL, HISTOGRAM} kind;
+    double a, b, c;     /* parameters, in the order of the spec */
+    int n;              /* histogram bins */
+    double *values;     /* value of each bin */
+    double *cumul;      /* cumulative count up to each bin, included */
+} dist_t;
+
+/* The model of a phase */
+typedef struct {
+    long ops;           /* requests of the phase */
+    dist_t size;        /* request sizes */
+    dist_t life;        /* lifetimes, in requests */
+    double grow_pct;    /* percent of the blocks that grow with realloc */
+    double grow_factor; /* growth of each realloc */
+    int grow_count;     /* reallocs of a growing block */
+    long live_max;      /* bound of the live bytes, 0 if none */
+} phase_t;
+
+/* A live block, on the heap of the next events */
+typedef struct {
+    long when;          /* request of its next event : a realloc, or its free */
+    int id;
+    int size;
+    int grows;          /* reallocs left */
+} block_t;
+
+/* Output and state of the generator */
+static FILE *out;
+static char *out_path;
+static int binary = 0;
+static unsigned long long rng_state = 88172645463325252ULL;
+static long num_ops = 0;       /* requests written */
+static long live_size = 0;     /* bytes of the live blocks */
+static long peak_size = 0;     /* max of live_size */
+
+/* Min-heap of the live blocks, by the request of their next event */
+static block_t *events;
+static int num_events = 0, max_events = 0;
+
+/* Free ids, reused before new ones */
+static int *free_ids;
+static int num_free_ids = 0, max_free_ids = 0, num_ids = 0;
+
+/*
+ * app_error - Report an error and exit
+ */
+static void app_error(char *msg, char *arg)
+{
+    fprintf(stderr, "gentrace: %s %s\n", msg, arg);
+    exit(1);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: gentrace [-b] [-S <seed>] [phase options] [-P phase options ...] <out>\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b         Write a binary trace instead of a .rep one.\n");
+    fprintf(stderr, "\t-g <p:f:c> p%% of the blocks grow by f with realloc, c times.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-l <dist>  Lifetimes of the blocks, in requests.\n");
+    fprintf(stderr, "\t-L <bytes> Bound of the live set.\n");
+    fprintf(stderr, "\t-n <ops>   Requests of the phase.\n");
+    fprintf(stderr, "\t-P         End the phase, the next options model the next one.\n");
+    fprintf(stderr, "\t-s <dist>  Request sizes in bytes.\n");
+    fprintf(stderr, "\t-S <seed>  Seed of the random generator.\n");
+    fprintf(stderr, "Distributions\n");
+    fprintf(stderr, "\tuni:<min>:<max>, exp:<mean>, pow:<alpha>:<min>:<max>,\n");
+    fprintf(stderr, "\tbimodal:<a>:<b>:<pct>, hist:<file of \"<value> <count>\" lines>\n");
+}
+
+/*
+ * rnd - Uniform random number in [0, 1), from a xorshift64* generator
+ *    so that a seed gives the same trace on every machine
+ */
+static double rnd(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * parse_hist - Reads the histogram of a dist from a file of
+ *    "<value> <count>" lines, # starting a comment
+ */
+static void parse_hist(dist_t *dist, char *path)
+{
+    FILE *fp;
+    char line[MAXLINE];
+    double value, count, total = 0;
+    int max = 0;
+
+    if ((fp = fopen(path, "r")) == NULL)
+	app_error("could not open", path);
+    dist->n = 0;
+    dist->values = dist->cumul = NULL;
+    while (fgets(line, MAXLINE, fp)) {
+	if (line[0] == '#' || sscanf(line, "%lf %lf", &value, &count) != 2)
+	    continue;
+	if (count <= 0)
+	    continue;
+	if (dist->n == max) {
+	    max = max ? 2 * max : 64;
+	    dist->values = realloc(dist->values, max * sizeof(double));
+	    dist->cumul = realloc(dist->cumul, max * sizeof(double));
+	    if (dist->values == NULL || dist->cumul == NULL)
+		app_error("out of memory reading", path);
+	}
+	total += count;
+	dist->values[dist->n] = value;
+	dist->cumul[dist->n++] = total;
+    }
+    fclose(fp);
+    if (dist->n == 0)
+	app_error("empty histogram", path);
+}
+
+/*
+ * parse_dist - Parses a distribution spec, see the header comment
+ */
+static void parse_dist(dist_t *dist, char *spec)
+{
+    char *params = strchr(spec, ':');
+    int n;
+
+    if (params == NULL)
+	app_error("bad distribution", spec);
+    params++;
+    dist->a = dist->b = dist->c = 0;
+    n = sscanf(params, "%lf:%lf:%lf", &dist->a, &dist->b, &dist->c);
+    if (!strncmp(spec, "uni:", 4) && n == 2 && dist->a <= dist->b)
+	dist->kind = UNIFORM;
+    else if (!strncmp(spec, "exp:", 4) && n == 1 && dist->a > 0)
+	dist->kind = EXPONENTIAL;
+    else if (!strncmp(spec, "pow:", 4) && n == 3 && dist->a > 0 &&
+	     dist->b > 0 && dist->b <= dist->c)
+	dist->kind = POWER;
+    else if (!strncmp(spec, "bimodal:", 8) && n == 3 &&
+	     dist->c >= 0 && dist->c <= 100)
+	dist->kind = BIMODAL;
+    else if (!strncmp(spec, "hist:", 5)) {
+	dist->kind = HISTOGRAM;
+	parse_hist(dist, params);
+    }
+    else
+	app_error("bad distribution", spec);
+}
+
+/*
+ * sample - Draws a value of a distribution
+ */
+static double sample(dist_t *dist)
+{
+    double u = rnd(), x, lo, hi;
+    int min, max, mid;
+
+    switch (dist->kind) {
+    case UNIFORM:
+	return dist->a + u * (dist->b - dist->a);
+    case EXPONENTIAL:
+	return -dist->a * log(1 - u);
+    case POWER:
+	/* Inverse of the cdf of x^-alpha on [min, max] */
+	lo = dist->b;
+	hi = dist->c;
+	if (fabs(dist->a - 1) < 1e-9)
+	    return lo * pow(hi / lo, u);
+	x = pow(lo, 1 - dist->a);
+	return pow(x + u * (pow(hi, 1 - dist->a) - x), 1 / (1 - dist->a));
+    case BIMODAL:
+	x = (rnd() * 100 < dist->c) ? dist->a : dist->b;
+	return x * (0.75 + u / 2);
+    case HISTOGRAM:
+	/* First bin whose cumulative count is above u */
+	x = u * dist->cumul[dist->n - 1];
+	min = 0;
+	max = dist->n - 1;
+	while (min < max) {
+	    mid = (min + max) / 2;
+	    if (dist->cumul[mid] > x)
+		max = mid;
+	    else
+		min = mid + 1;
+	}
+	return dist->values[min];
+    }
+    return 0;
+}
+
+/*
+ * write_header - Writes the header of the trace at the start of the
+ *    output, with fixed width fields in a .rep so that it can be
+ *    rewritten once the requests are known
+ */
+static void write_header(void)
+{
+    trace_header_t header;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.opsize = sizeof(traceop_t);
+    header.sugg_heapsize = peak_size > INT_MAX ? INT_MAX : (int)peak_size;
+    header.num_ids = num_ids;
+    header.num_ops = (int)num_ops;
+    header.weight = 1;
+
+    rewind(out);
+    if (binary) {
+	if (fwrite(&header, sizeof(header), 1, out) != 1)
+	    app_error("could not write", out_path);
+    }
+    else if (fprintf(out, "%-*d\n%-*d\n%-*d\n%-*d\n",
+		     REP_FIELD, header.sugg_heapsize, REP_FIELD, header.num_ids,
+		     REP_FIELD, header.num_ops, REP_FIELD, header.weight) < 0)
+	app_error("could not write", out_path);
+}
+
+/*
+ * emit - Writes a request
+ */
+static void emit(int type, int id, int size)
+{
+    traceop_t op;
+    int ret;
+
+    if (num_ops == INT_MAX)
+	app_error("more requests than a trace holds in", out_path);
+    num_ops++;
+    if (binary) {
+	memset(&op, 0, sizeof(op));
+	op.type = type;
+	op.index = id;
+	op.size = size;
+	if (fwrite(&op, sizeof(op), 1, out) != 1)
+	    app_error("could not write", out_path);
+	return;
+    }
+    if (type == ALLOC)
+	ret = fprintf(out, "a %d %d\n", id, size);
+    else if (type == REALLOC)
+	ret = fprintf(out, "r %d %d\n", id, size);
+    else
+	ret = fprintf(out, "f %d\n", id);
+    if (ret < 0)
+	app_error("could not write", out_path);
+}
+
+/*
+ * push_event, pop_event - Insert in and remove the top of the min-heap
+ *    of the live blocks
+ */
+static void push_event(block_t *block)
+{
+    int i, parent;
+
+    if (num_events == max_events) {
+	max_events = max_events ? 2 * max_events : 1024;
+	if ((events = realloc(events, max_events * sizeof(block_t))) == NULL)
+	    app_error("out of memory for the live blocks of", out_path);
+    }
+    for (i = num_events++; i > 0; i = parent) {
+	parent = (i - 1) / 2;
+	if (events[parent].when <= block->when)
+	    break;
+	events[i] = events[parent];
+    }
+    events[i] = *block;
+}
+
+static void pop_event(block_t *block)
+{
+    block_t last = events[--num_events];
+    int i = 0, child;
+
+    *block = events[0];
+    while ((child = 2 * i + 1) < num_events) {
+	if (child + 1 < num_events && events[child + 1].when < events[child].when)
+	    child++;
+	if (last.when <= events[child].when)
+	    break;
+	events[i] = events[child];
+	i = child;
+    }
+    events[i] = last;
+}
+
+/*
+ * new_id, free_id - Hand out and give back block ids
+ */
+static int new_id(void)
+{
+    if (num_free_ids > 0)
+	return free_ids[--num_free_ids];
+    if (num_ids == INT_MAX)
+	app_error("too many live blocks in", out_path);
+    return num_ids++;
+}
+
+static void free_id(int id)
+{
+    if (num_free_ids == max_free_ids) {
+	max_free_ids = max_free_ids ? 2 * max_free_ids : 1024;
+	if ((free_ids = realloc(free_ids, max_free_ids * sizeof(int))) == NULL)
+	    app_error("out of memory for the ids of", out_path);
+    }
+    free_ids[num_free_ids++] = id;
+}
+
+/*
+ * clamp_size - Rounds a sampled size to a valid request size
+ */
+static int clamp_size(double size)
+{
+    if (size < 1)
+	return 1;
+    if (size > INT_MAX / 2)
+	return INT_MAX / 2;
+    return (int)size;
+}
+
+/*
+ * lifetime - Samples the number of requests until the next event of a block
+ */
+static long lifetime(phase_t *phase)
+{
+    double life = sample(&phase->life);
+
+    return life < 1 ? 1 : (life > LONG_MAX / 4 ? LONG_MAX / 4 : (long)life);
+}
+
+/*
+ * free_block - Frees a live block popped from the events
+ */
+static void free_block(block_t *block)
+{
+    emit(FREE, block->id, 0);
+    live_size -= block->size;
+    free_id(block->id);
+}
+
+/*
+ * run_phase - Writes the requests of a phase : the events of the live
+ *    blocks that are due, an allocation otherwise
+ */
+static void run_phase(phase_t *phase)
+{
+    long end = num_ops + phase->ops, now;
+    block_t block;
+    int size;
+
+    while ((now = num_ops) < end) {
+	if (num_events > 0 && events[0].when <= now) {
+	    pop_event(&block);
+	    if (block.grows == 0) {
+		free_block(&block);
+		continue;
+	    }
+	    size = clamp_size(block.size * phase->grow_factor);
+	    emit(REALLOC, block.id, size);
+	    live_size += size - block.size;
+	    block.size = size;
+	    block.grows--;
+	    block.when = now + lifetime(phase);
+	    push_event(&block);
+	}
+	else {
+	    size = clamp_size(sample(&phase->size));
+
+	    /* Free the blocks closest to their death to stay in the bound */
+	    if (phase->live_max > 0 && num_events > 0 &&
+		live_size + size > phase->live_max) {
+		pop_event(&block);
+		free_block(&block);
+		continue;
+	    }
+	    block.id = new_id();
+	    block.size = size;
+	    block.grows = (rnd() * 100 < phase->grow_pct) ? phase->grow_count : 0;
+	    block.when = now + lifetime(phase);
+	    emit(ALLOC, block.id, size);
+	    live_size += size;
+	    push_event(&block);
+	}
+	if (live_size > peak_size)
+	    peak_size = live_size;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    phase_t phases[MAX_PHASES];
+    int num_phases = 1;
+    phase_t *phase = &phases[0];
+    block_t block;
+    char c;
+    int i;
+
+    /* The default model */
+    memset(phase, 0, sizeof(*phase));
+    phase->ops = 1000000;
+    parse_dist(&phase->size, "pow:1.5:8:16384");
+    parse_dist(&phase->life, "exp:1000");
+
+    while ((c = getopt(argc, argv, "bS:n:s:l:g:L:Ph")) != EOF) {
+	switch (c) {
+	case 'b': /* Binary trace */
+	    binary = 1;
+	    break;
+	case 'S': /* Seed */
+	    rng_state = strtoull(optarg, NULL, 0) * 2654435761ULL + 88172645463325252ULL;
+	    break;
+	case 'n': /* Requests of the phase */
+	    if ((phase->ops = atol(optarg)) <= 0)
+		app_error("bad number of requests", optarg);
+	    break;
+	case 's': /* Sizes */
+	    parse_dist(&phase->size, optarg);
+	    break;
+	case 'l': /* Lifetimes */
+	    parse_dist(&phase->life, optarg);
+	    break;
+	case 'g': /* Realloc growth */
+	    if (sscanf(optarg, "%lf:%lf:%d", &phase->grow_pct,
+		       &phase->grow_factor, &phase->grow_count) != 3 ||
+		phase->grow_factor <= 0 || phase->grow_count < 0)
+		app_error("bad growth", optarg);
+	    break;
+	case 'L': /* Live set bound */
+	    phase->live_max = atol(optarg);
+	    break;
+	case 'P': /* Next phase, starting from the model of this one */
+	    if (num_phases == MAX_PHASES)
+		app_error("too many phases", "");
+	    phases[num_phases] = *phase;
+	    phase = &phases[num_phases++];
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (optind != argc - 1) {
+	usage();
+	exit(1);
+    }
+    out_path = argv[optind];
+    if ((out = fopen(out_path, "w")) == NULL)
+	app_error("could not create", out_path);
+
+    /* Room for the header, rewritten once the requests are known */
+    write_header();
+
+    for (i = 0; i < num_phases; i++)
+	run_phase(&phases[i]);
+    while (num_events > 0) {
+	pop_event(&block);
+	free_block(&block);
+    }
+
+    write_header();
+    if (fclose(out) != 0)
+	app_error("could not write", out_path);
+    return 0;
+}
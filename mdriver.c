@@ -13,13 +13,28 @@
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <stdint.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <math.h>
+#include <dlfcn.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "clock.h"
 #include "config.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -31,26 +46,24 @@
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((uintptr_t)(p)) % ALIGNMENT) == 0)
 
 /****************************** 
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* 
+ * Records the extent of each block's payload. Ranges are kept in a
+ * treap : a binary search tree on lo, which is also a heap on prio.
+ */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    unsigned prio;         /* random priority, larger than its children's */
+    struct range_t *left;  /* ranges at lower addresses */
+    struct range_t *right; /* ranges at higher addresses */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
@@ -58,6 +71,8 @@ typedef struct {
     int num_ops;         /* number of distinct requests */
     int weight;          /* weight for this trace (unused) */
     traceop_t *ops;      /* array of requests */
+    void *map;           /* mapping of a binary trace file, holding ops */
+    size_t map_size;     /* ... and its size */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
 } trace_t;
@@ -70,14 +85,124 @@ typedef struct {
 typedef struct {
     trace_t *trace;  
     range_t *ranges;
+    struct allocator *alloc; /* allocator replayed by eval_libc_speed */
+    struct snapshot *snap;   /* heap restored by eval_mm_phase */
 } speed_t;
 
+/*
+ * Snapshot of the heap once the first requests of a trace are replayed
+ * (-s) : the memory of memlib, the state of the mm package out of it,
+ * and the block tables of the trace. eval_mm_phase restores it and only
+ * replays the requests that follow.
+ */
+typedef struct snapshot {
+    int first_op;             /* first request replayed after a restore */
+    struct mem_snapshot *mem;
+    void *mm_state;
+    char **blocks;
+    size_t *block_sizes;
+} snapshot_t;
+
+/* 
+ * Blocks one thread hands to the next one to free in the -T mode. Each
+ * ring has a single producer and a single consumer.
+ */
+#define RING_SIZE 1024
+typedef struct {
+    char *slots[RING_SIZE];
+    unsigned head;       /* next slot the consumer reads */
+    unsigned tail;       /* next slot the producer writes */
+} ring_t;
+
+/* Holds the params and the results of one thread of the -T mode */
+typedef struct {
+    trace_t *trace;      /* trace replayed by the thread */
+    int id;              /* thread number, from 0 */
+    int nthreads;        /* number of threads replaying the trace */
+    char **blocks;       /* this thread's ptrs returned by malloc/realloc */
+    ring_t *inbox;       /* blocks the previous thread hands to this one */
+    ring_t *outbox;      /* blocks this thread hands to the next one */
+    double secs;         /* time the thread took to replay the trace */
+} mt_thread_t;
+
+/*
+ * Streaming replay (-S) : a reader thread reads the ops of a trace in
+ * chunks of STREAM_CHUNK, into one buffer while the other one is
+ * replayed, so that only two chunks are ever in memory.
+ */
+#define STREAM_CHUNK 65536
+typedef struct {
+    FILE *file;             /* the trace file, past its header */
+    char *path;
+    int binary;             /* binary trace (see trace.h), else .rep */
+    traceop_t *bufs[2];
+    int counts[2];          /* ops in each buffer, 0 at the end of the trace */
+    int ready[2];           /* buffer filled and not replayed yet */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} stream_t;
+
+/* 
+ * Per-operation latency histograms (-L), HDR-style : values below HIST_SUB
+ * are counted exactly, larger ones in HIST_SUB buckets per power of two,
+ * so that they are known within 1/HIST_SUB of their value.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+typedef struct {
+    unsigned long long counts[HIST_BUCKETS];
+    unsigned long long n;    /* number of values recorded */
+    unsigned long long max;  /* exact largest value */
+} hist_t;
+
+/* Latency summary of one request type on one trace, in cycles */
+typedef struct {
+    unsigned long long n, p50, p99, p999, max;
+} latency_t;
+
+/*
+ * Locality mode (-m) : the replay writes the payload of each block it
+ * allocates, and after each request reads blocks as the pattern says :
+ * the last RECENT_BLOCKS allocated (recent), or CHASE_HOPS links of a
+ * list of the live blocks in allocation order, kept in their payloads
+ * (chase). At most TOUCH_MAX_LINES lines of a block are touched.
+ */
+#define TOUCH_NONE 0
+#define TOUCH_RECENT 1
+#define TOUCH_CHASE 2
+#define TOUCH_LINE 64
+#define TOUCH_MAX_LINES 8
+#define RECENT_BLOCKS 16
+#define CHASE_HOPS 16
+
+/* Links of a block in the list of -m chase, at the start of its payload */
+typedef struct link {
+    struct link *next;   /* block allocated before it */
+    struct link *prev;   /* block allocated after it */
+} link_t;
+
+/* Locality summary of one trace : the hardware counters cover the whole
+ * replay, requests included, and are -1 if the system has none */
+typedef struct {
+    int ops;                       /* requests replayed */
+    unsigned long long accesses;   /* cache lines written or read */
+    unsigned long long cycles;     /* cycles spent in the accesses */
+    unsigned long long total;      /* cycles of the whole replay */
+    long long llc_misses;          /* last level cache read misses */
+    long long dtlb_misses;         /* data TLB read misses */
+} locality_t;
+
+/* Longest run of requests replayed with one mm_malloc_batch or mm_free_batch (-b) */
+#define BATCH_MAX 64
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
     double ops;      /* number of ops (malloc/free/realloc) in the trace */
     int valid;       /* was the trace processed correctly by the allocator? */
     double secs;     /* number of secs needed to run the trace */
+    double secs_ci;  /* half width of the 95% confidence interval of secs (-r) */
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
@@ -85,6 +210,20 @@ typedef struct {
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* 
+ * An allocator with the interface of libc, replayed by eval_libc_valid
+ * and eval_libc_speed : libc itself (-l), or a shared library (-A)
+ */
+#define MAX_ALLOCATORS 8
+typedef struct allocator {
+    char *name;
+    void *(*malloc_fn)(size_t);
+    void (*free_fn)(void *);
+    void *(*realloc_fn)(void *, size_t);
+    int (*memalign_fn)(void **, size_t, size_t); /* NULL if it has none */
+    stats_t *stats;      /* results for each trace */
+} allocator_t;
+
 /********************
  * Global variables
  *******************/
@@ -95,6 +234,37 @@ char msg[MAXLINE];      /* for whenever we need to compose an error message */
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
+/* Multi-thread mode : number of threads (-T), and percentage of the
+ * frees handed to another thread (-p) */
+static int num_threads = 0;
+static int handoff_pct = 25;
+static int streaming = 0;  /* replay traces with eval_mm_stream (-S) */
+static int latency = 0;    /* time each request with eval_mm_latency (-L) */
+static int heap_check = 0; /* run mm_check_step after each request (-c) */
+static int batching = 0;   /* replay runs of requests with the batch calls (-b) */
+static int touch_pattern = TOUCH_NONE; /* payload accesses of eval_mm_locality (-m) */
+static volatile unsigned long touch_sink; /* what eval_mm_locality read */
+static int zeroing = 0;    /* replay allocs with mm_calloc (-z) */
+static int snapshot_op = 0; /* time the traces from this request on (-s) */
+
+/* Benchmark harness : timed runs of each trace (-r), file of per-trace
+ * results (-o), results to compare with (-B) and the regression that
+ * fails the comparison, in percent (-x) */
+static int num_runs = 1;
+static char *output_file = NULL;
+static char *baseline_file = NULL;
+static double tolerance = 5.0;
+
+/* Allocators run beside the mm package, libc first if -l is given */
+static allocator_t allocators[MAX_ALLOCATORS];
+static int num_allocators = 0;
+
+/* One histogram per request type (ALLOC, FREE, REALLOC, MEMALIGN), static so that
+ * recording latencies allocates nothing */
+static hist_t hists[NUM_OP_TYPES];
+static pthread_barrier_t mt_barrier; /* threads start replaying together */
+static pthread_barrier_t mt_done;    /* threads drain their inbox once all are done */
+
 /* The filenames of the default tracefiles */
 static char *default_tracefiles[] = {  
     DEFAULT_TRACEFILES, NULL
@@ -110,13 +280,16 @@ static int add_range(range_t **ranges, char *lo, int size,
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static range_t *range_insert(range_t *root, range_t *node);
+static range_t *range_merge(range_t *left, range_t *right);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static int map_trace(trace_t *trace, char *path);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
-static int eval_libc_valid(trace_t *trace, int tracenum);
+static int eval_libc_valid(allocator_t *alloc, trace_t *trace, int tracenum);
 static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
@@ -124,6 +297,37 @@ static void eval_libc_speed(void *ptr);
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static void replay_ops(trace_t *trace, int lo, int hi);
+static snapshot_t *snapshot_take(trace_t *trace, int op);
+static void snapshot_free(snapshot_t *snap);
+static void eval_mm_phase(void *ptr);
+static int batch_run(trace_t *trace, int i);
+static int replay_batch(trace_t *trace, int i, int n);
+
+/* Routines for measuring the latency of each request */
+static void eval_mm_latency(trace_t *trace, latency_t *lat);
+static unsigned long long hist_percentile(hist_t *hist, double pct);
+static void printlatency(int n, latency_t *lat);
+
+/* Locality of the blocks, as seen by the application (-m) */
+static void eval_mm_locality(trace_t *trace, locality_t *loc);
+static int touch_write(char *p, size_t size, size_t skip);
+static int touch_read(char *p, size_t size, unsigned long *sum);
+static int perf_open(int dtlb);
+static long long perf_stop(int fd);
+static void printlocality(int n, locality_t *loc);
+
+/* Routines for replaying a trace without loading it whole */
+static void eval_mm_stream(char *tracedir, char *filename, int tracenum, stats_t *stats);
+static void *stream_reader(void *arg);
+static int stream_read_chunk(stream_t *stream, traceop_t *buf);
+
+/* Routines for evaluating the mm package on several threads at once */
+static void eval_mm_threads(char **tracefiles, int num_tracefiles);
+static double eval_mm_mt(trace_t *trace, int nthreads, double *thread_secs);
+static void *mt_replay(void *arg);
+static int ring_push(ring_t *ring, char *p);
+static void ring_drain(ring_t *ring);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
@@ -132,23 +336,32 @@ static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
 static void app_error(char *msg);
 
+/* Routines of the benchmark harness */
+static double time_trace(fsecs_test_funct f, speed_t *params, double *ci);
+static void add_allocator(char *name, char *path);
+static void printcompare(int n, stats_t *mm_stats);
+static void writeresult(FILE *fp, int json, char *name, char *trace, stats_t *stats);
+static void writeresults(char *path, char **tracefiles, int n, stats_t *mm_stats);
+static int checkbaseline(char *path, char **tracefiles, int n, stats_t *mm_stats);
+
 /**************
  * Main routine
  **************/
 int main(int argc, char **argv)
 {
-    int i;
+    int i, j;
     char c;
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
     range_t *ranges = NULL;    /* keeps track of block extents for one trace */
-    stats_t *libc_stats = NULL;/* libc stats for each trace */
+    allocator_t *alloc;        /* libc or another allocator (-l, -A) */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
+    latency_t *mm_latency = NULL; /* mm latencies, NUM_OP_TYPES per trace */
+    locality_t *mm_locality = NULL; /* mm locality for each trace (-m) */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
 
     int team_check = 1;  /* If set, check team structure (reset by -a) */
-    int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
 
     /* temporaries used to compute the performance index */
@@ -158,7 +371,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:hvVgabclT:p:SLr:o:B:x:A:m:zs:")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -182,7 +395,68 @@ int main(int argc, char **argv)
             team_check = 0;
             break;
         case 'l': /* Run libc malloc */
-            run_libc = 1;
+            add_allocator("libc", NULL);
+            break;
+        case 'A': /* Run the allocator of a shared library */
+            add_allocator(NULL, optarg);
+            break;
+        case 'r': /* Time each trace over several runs */
+            num_runs = atoi(optarg);
+            if (num_runs < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'o': /* Write the per-trace results to a file */
+            output_file = optarg;
+            break;
+        case 'B': /* Compare the results with those of a baseline file */
+            baseline_file = optarg;
+            break;
+        case 'x': /* Regression, in percent, that fails the comparison */
+            tolerance = atof(optarg);
+            break;
+        case 'b': /* Replay runs of allocs or frees with the batch calls */
+            batching = 1;
+            break;
+        case 'c': /* Check the heap incrementally while replaying */
+            heap_check = 1;
+            break;
+        case 'T': /* Also replay the traces on several threads at once */
+            num_threads = atoi(optarg);
+            if (num_threads < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'L': /* Measure the latency of each request */
+            latency = 1;
+            break;
+        case 'm': /* Touch the payloads, and measure their locality */
+            if (!strcmp(optarg, "recent"))
+                touch_pattern = TOUCH_RECENT;
+            else if (!strcmp(optarg, "chase"))
+                touch_pattern = TOUCH_CHASE;
+            else {
+                usage();
+                exit(1);
+            }
+            break;
+        case 's': /* Time the traces from a snapshot taken at a request */
+            snapshot_op = atoi(optarg);
+            if (snapshot_op < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'z': /* Replay the allocs with mm_calloc */
+            zeroing = 1;
+            break;
+        case 'S': /* Stream the traces instead of loading them */
+            streaming = 1;
+            break;
+        case 'p': /* Percentage of frees done by another thread with -T */
+            handoff_pct = atoi(optarg);
             break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
@@ -239,37 +513,40 @@ int main(int argc, char **argv)
     init_fsecs();
 
     /*
-     * Optionally run and evaluate the libc malloc package 
+     * Optionally run and evaluate libc malloc and the other allocators 
      */
-    if (run_libc) {
+    for (j = 0; j < num_allocators; j++) {
+	alloc = &allocators[j];
 	if (verbose > 1)
-	    printf("\nTesting libc malloc\n");
+	    printf("\nTesting %s malloc\n", alloc->name);
 	
-	/* Allocate libc stats array, with one stats_t struct per tracefile */
-	libc_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
-	if (libc_stats == NULL)
-	    unix_error("libc_stats calloc in main failed");
+	/* Allocate the stats array, with one stats_t struct per tracefile */
+	alloc->stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+	if (alloc->stats == NULL)
+	    unix_error("allocator stats calloc in main failed");
 	
-	/* Evaluate the libc malloc package using the K-best scheme */
+	/* Evaluate the allocator using the K-best scheme */
 	for (i=0; i < num_tracefiles; i++) {
 	    trace = read_trace(tracedir, tracefiles[i]);
-	    libc_stats[i].ops = trace->num_ops;
+	    alloc->stats[i].ops = trace->num_ops;
 	    if (verbose > 1)
-		printf("Checking libc malloc for correctness, ");
-	    libc_stats[i].valid = eval_libc_valid(trace, i);
-	    if (libc_stats[i].valid) {
+		printf("Checking %s malloc for correctness, ", alloc->name);
+	    alloc->stats[i].valid = eval_libc_valid(alloc, trace, i);
+	    if (alloc->stats[i].valid) {
 		speed_params.trace = trace;
+		speed_params.alloc = alloc;
 		if (verbose > 1)
 		    printf("and performance.\n");
-		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+		alloc->stats[i].secs = time_trace(eval_libc_speed, &speed_params,
+						  &alloc->stats[i].secs_ci);
 	    }
 	    free_trace(trace);
 	}
 
-	/* Display the libc results in a compact table */
+	/* Display the results in a compact table */
 	if (verbose) {
-	    printf("\nResults for libc malloc:\n");
-	    printresults(num_tracefiles, libc_stats);
+	    printf("\nResults for %s malloc:\n", alloc->name);
+	    printresults(num_tracefiles, alloc->stats);
 	}
     }
 
@@ -283,12 +560,20 @@ int main(int argc, char **argv)
     mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
+    if (latency && (mm_latency = (latency_t *)calloc(NUM_OP_TYPES * num_tracefiles, sizeof(latency_t))) == NULL)
+	unix_error("mm_latency calloc in main failed");
+    if (touch_pattern && (mm_locality = (locality_t *)calloc(num_tracefiles, sizeof(locality_t))) == NULL)
+	unix_error("mm_locality calloc in main failed");
     
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
 
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
+	if (streaming) {
+	    eval_mm_stream(tracedir, tracefiles[i], i, &mm_stats[i]);
+	    continue;
+	}
 	trace = read_trace(tracedir, tracefiles[i]);
 	mm_stats[i].ops = trace->num_ops;
 	if (verbose > 1)
@@ -300,9 +585,32 @@ int main(int argc, char **argv)
 	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
+	    speed_params.snap = NULL;
 	    if (verbose > 1)
 		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    if (snapshot_op >= trace->num_ops)
+		fprintf(stderr, "Warning: -s %d is past the last request of %s, "
+			"timing the whole trace\n", snapshot_op, tracefiles[i]);
+	    if (snapshot_op > 0 && snapshot_op < trace->num_ops) {
+		speed_params.snap = snapshot_take(trace, snapshot_op);
+		mm_stats[i].ops = trace->num_ops - snapshot_op;
+		mm_stats[i].secs = time_trace(eval_mm_phase, &speed_params,
+					      &mm_stats[i].secs_ci);
+		snapshot_free(speed_params.snap);
+	    }
+	    else
+		mm_stats[i].secs = time_trace(eval_mm_speed, &speed_params,
+					      &mm_stats[i].secs_ci);
+	    if (latency) {
+		if (verbose > 1)
+		    printf("Measuring the latency of each request.\n");
+		eval_mm_latency(trace, &mm_latency[NUM_OP_TYPES * i]);
+	    }
+	    if (touch_pattern) {
+		if (verbose > 1)
+		    printf("Measuring the locality of the blocks.\n");
+		eval_mm_locality(trace, &mm_locality[i]);
+	    }
 	}
 	free_trace(trace);
     }
@@ -313,6 +621,21 @@ int main(int argc, char **argv)
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
     }
+    if (latency && errors == 0 && !streaming)
+	printlatency(num_tracefiles, mm_latency);
+    if (touch_pattern && errors == 0 && !streaming)
+	printlocality(num_tracefiles, mm_locality);
+    if (num_allocators > 0)
+	printcompare(num_tracefiles, mm_stats);
+
+    /*
+     * Optionally replay the traces on several threads at once
+     */
+    if (num_threads > 0 && errors == 0) {
+	if (!mm_threadsafe)
+	    app_error("-T needs an mm package built with MM_THREADSAFE (make mdriver-mt)");
+	eval_mm_threads(tracefiles, num_tracefiles);
+    }
 
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
@@ -362,14 +685,24 @@ int main(int argc, char **argv)
 	printf("perfidx:%.0f\n", perfindex);
     }
 
+    /* 
+     * Write the results, then fail if they regressed from the baseline 
+     */
+    if (output_file)
+	writeresults(output_file, tracefiles, num_tracefiles, mm_stats);
+    if (baseline_file &&
+	checkbaseline(baseline_file, tracefiles, num_tracefiles, mm_stats))
+	exit(1);
+
     exit(0);
 }
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks, in
+ * O(log n) expected time per operation.
  ****************************************************************/
 
 /*
@@ -382,8 +715,9 @@ static int add_range(range_t **ranges, char *lo, int size,
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *pred = NULL, *succ = NULL;
     char msg[MAXLINE];
+    static unsigned seed = 1;
 
     assert(size > 0);
 
@@ -395,39 +729,104 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or in memory
+     * the allocator mapped for it */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mem_is_mapped(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    /* 
+     * The payload must not overlap any other payloads : since those don't
+     * overlap each other, only its neighbors by address can
+     */
+    for (p = *ranges;  p != NULL; ) {
+	if (p->lo <= lo) {
+	    pred = p;
+	    p = p->right;
+	}
+	else {
+	    succ = p;
+	    p = p->left;
+	}
+    }
+    p = (pred != NULL && pred->hi >= lo) ? pred : 
+	(succ != NULL && succ->lo <= hi) ? succ : NULL;
+    if (p != NULL) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, p->lo, p->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 	unix_error("malloc error in add_range");
-    p->next = *ranges;
+    seed = seed * 1103515245 + 12345;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    p->prio = seed;
+    p->left = p->right = NULL;
+    *ranges = range_insert(*ranges, p);
     return 1;
 }
 
+/*
+ * range_insert - Insert node in the treap rooted at root, returns the
+ *     new root
+ */
+static range_t *range_insert(range_t *root, range_t *node)
+{
+    range_t *child;
+
+    if (root == NULL)
+	return node;
+    if (node->lo < root->lo) {
+	root->left = range_insert(root->left, node);
+	if (root->left->prio > root->prio) { /* rotate right */
+	    child = root->left;
+	    root->left = child->right;
+	    child->right = root;
+	    return child;
+	}
+    }
+    else {
+	root->right = range_insert(root->right, node);
+	if (root->right->prio > root->prio) { /* rotate left */
+	    child = root->right;
+	    root->right = child->left;
+	    child->left = root;
+	    return child;
+	}
+    }
+    return root;
+}
+
+/*
+ * range_merge - Merge two treaps, all the ranges of left being below
+ *     those of right, returns the new root
+ */
+static range_t *range_merge(range_t *left, range_t *right)
+{
+    if (left == NULL)
+	return right;
+    if (right == NULL)
+	return left;
+    if (left->prio > right->prio) {
+	left->right = range_merge(left->right, right);
+	return left;
+    }
+    right->left = range_merge(left, right->left);
+    return right;
+}
+
 /* 
  * remove_range - Free the range record of block whose payload starts at lo 
  */
@@ -435,16 +834,14 @@ static void remove_range(range_t **ranges, char *lo)
 {
     range_t *p;
     range_t **prevpp = ranges;
-    int size;
 
-    for (p = *ranges;  p != NULL; p = p->next) {
+    for (p = *ranges;  p != NULL; p = *prevpp) {
         if (p->lo == lo) {
-	    *prevpp = p->next;
-            size = p->hi - p->lo + 1;
+	    *prevpp = range_merge(p->left, p->right);
             free(p);
             break;
         }
-        prevpp = &(p->next);
+        prevpp = (lo < p->lo) ? &(p->left) : &(p->right);
     }
 }
 
@@ -453,13 +850,11 @@ static void remove_range(range_t **ranges, char *lo)
  */
 static void clear_ranges(range_t **ranges)
 {
-    range_t *p;
-    range_t *pnext;
-
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
-    }
+    if (*ranges == NULL)
+	return;
+    clear_ranges(&(*ranges)->left);
+    clear_ranges(&(*ranges)->right);
+    free(*ranges);
     *ranges = NULL;
 }
 
@@ -477,7 +872,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    unsigned index, size, align;
     unsigned max_index = 0;
     unsigned op_index;
 
@@ -495,6 +890,14 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
+
+    /* Binary traces are mapped as they are */
+    trace->map = NULL;
+    if (map_trace(trace, path)) {
+	fclose(tracefile);
+	return trace;
+    }
+
     fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
     fscanf(tracefile, "%d", &(trace->num_ids));     
     fscanf(tracefile, "%d", &(trace->num_ops));     
@@ -534,6 +937,14 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].size = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
+	case 'm':
+	    fscanf(tracefile, "%u %u %u", &index, &size, &align);
+	    trace->ops[op_index].type = MEMALIGN;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].align = align;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
 	case 'f':
 	    fscanf(tracefile, "%ud", &index);
 	    trace->ops[op_index].type = FREE;
@@ -554,13 +965,89 @@ static trace_t *read_trace(char *tracedir, char *filename)
     return trace;
 }
 
+/*
+ * map_trace - If path is a binary trace (see trace.h), map its ops
+ *     read-only and allocate the block arrays. Returns 0 if it is not.
+ */
+static int map_trace(trace_t *trace, char *path)
+{
+    int fd;
+    struct stat st;
+    trace_header_t *header;
+    traceop_t *op;
+    char *why;
+    int i;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+	sprintf(msg, "Could not open %s in map_trace", path);
+	unix_error(msg);
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(trace_header_t)) {
+	close(fd);
+	return 0;
+    }
+    /* Shared mapping : runs on the same trace share the page cache */
+    header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+	unix_error("mmap failed in map_trace");
+    if (header->magic != TRACE_MAGIC) {
+	munmap(header, st.st_size);
+	return 0;
+    }
+    if (header->version != TRACE_VERSION || header->opsize != sizeof(traceop_t) ||
+	st.st_size != sizeof(trace_header_t) + (size_t)header->num_ops * sizeof(traceop_t)) {
+	sprintf(msg, "%s is not a binary trace for this machine", path);
+	app_error(msg);
+    }
+    if (header->num_ids < 0 || header->num_ops < 0) {
+	sprintf(msg, "Bad header in %s", path);
+	app_error(msg);
+    }
+
+    /* The ops are replayed as they are : check them all once here */
+    for (i = 0, op = (traceop_t *)(header + 1); i < header->num_ops; i++, op++) {
+	if ((unsigned)op->type >= NUM_OP_TYPES)
+	    why = "bogus request type";
+	else if (op->index < 0 || op->index >= header->num_ids)
+	    why = "request id out of range";
+	else if (op->type != FREE && op->size < 0)
+	    why = "negative request size";
+	else if (op->type == MEMALIGN && (op->align <= 0 || (op->align & (op->align - 1))))
+	    why = "alignment not a power of two";
+	else
+	    continue;
+	sprintf(msg, "Request %d of %s: %s", i, path, why);
+	app_error(msg);
+    }
+
+    trace->map = header;
+    trace->map_size = st.st_size;
+    trace->sugg_heapsize = header->sugg_heapsize;
+    trace->num_ids = header->num_ids;
+    trace->num_ops = header->num_ops;
+    trace->weight = header->weight;
+    trace->ops = (traceop_t *)(header + 1);
+
+    if ((trace->blocks = 
+	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	unix_error("malloc 3 failed in map_trace");
+    if ((trace->block_sizes = 
+	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc 4 failed in map_trace");
+    return 1;
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
  *              to, all of which were allocated in read_trace().
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->map != NULL)   /* unmap binary traces... */
+	munmap(trace->map, trace->map_size);
+    else
+	free(trace->ops);     /* or free the three arrays... */
     free(trace->blocks);      
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
@@ -576,7 +1063,7 @@ void free_trace(trace_t *trace)
  */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
 {
-    int i, j;
+    int i, j, n;
     int index;
     int size;
     int oldsize;
@@ -594,17 +1081,43 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	return 0;
     }
 
+    /* Requests no heap can hold must fail, not wrap to a small block */
+    if (mm_malloc((size_t)-1 - 3) != NULL ||
+	mm_calloc(1, (size_t)-1 - 3) != NULL ||
+	mm_calloc(2, (size_t)-1 / 2 + 1) != NULL) {
+	malloc_error(tracenum, 0, "impossible request did not fail.");
+	return 0;
+    }
+
     /* Interpret each operation in the trace in order */
     for (i = 0;  i < trace->num_ops;  i++) {
 	index = trace->ops[i].index;
 	size = trace->ops[i].size;
 
-        switch (trace->ops[i].type) {
+	/* With -b, a run of allocs of the same size or of frees is one call */
+	if (batching && (n = batch_run(trace, i)) > 1) {
+	    if (trace->ops[i].type == FREE)
+		for (j = 0; j < n; j++)
+		    remove_range(ranges, trace->blocks[trace->ops[i + j].index]);
+	    if (!replay_batch(trace, i, n)) {
+		malloc_error(tracenum, i, "mm_malloc_batch failed.");
+		return 0;
+	    }
+	    for (j = 0; j < n && trace->ops[i].type == ALLOC; j++) {
+		index = trace->ops[i + j].index;
+		p = trace->blocks[index];
+		if (add_range(ranges, p, size, tracenum, i + j) == 0)
+		    return 0;
+		memset(p, index & 0xFF, size);
+	    }
+	    i += n - 1;
+	}
+	else switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
 
-	    /* Call the student's malloc */
-	    if ((p = mm_malloc(size)) == NULL) {
+	    /* Call the student's malloc, or calloc with -z */
+	    if ((p = zeroing ? mm_calloc(1, size) : mm_malloc(size)) == NULL) {
 		malloc_error(tracenum, i, "mm_malloc failed.");
 		return 0;
 	    }
@@ -616,6 +1129,13 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	     */ 
 	    if (add_range(ranges, p, size, tracenum, i) == 0)
 		return 0;
+
+	    /* With -z, the payload must be zero */
+	    for (j = 0; zeroing && j < size; j++)
+		if (p[j] != 0) {
+		    malloc_error(tracenum, i, "mm_calloc returned a block that is not zero.");
+		    return 0;
+		}
 	    
 	    /* ADDED: cgw
 	     * fill range with low byte of index.  This will be used later
@@ -629,8 +1149,30 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    trace->block_sizes[index] = size;
 	    break;
 
+        case MEMALIGN: /* mm_memalign */
+
+	    /* Call the student's memalign */
+	    if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_memalign failed.");
+		return 0;
+	    }
+
+	    /* The payload must start on the requested boundary */
+	    if ((size_t)p % trace->ops[i].align != 0) {
+		malloc_error(tracenum, i, "mm_memalign returned a misaligned block.");
+		return 0;
+	    }
+	    if (add_range(ranges, p, size, tracenum, i) == 0)
+		return 0;
+	    memset(p, index & 0xFF, size);
+
+	    /* Remember region */
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
         case REALLOC: /* mm_realloc */
-	    
+
 	    /* Call the student's realloc */
 	    oldp = trace->blocks[index];
 	    if ((newp = mm_realloc(oldp, size)) == NULL) {
@@ -653,7 +1195,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -678,6 +1220,12 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
 
+	/* Check the blocks the request touched, and a few more */
+	if (heap_check && (p = mm_check_step()) != NULL) {
+	    sprintf(msg, "heap check failed at %p", p);
+	    malloc_error(tracenum, i, msg);
+	    return 0;
+	}
     }
 
     /* As far as we know, this is a valid malloc package */
@@ -697,11 +1245,11 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 {   
-    int i;
+    int i, j, n;
     int index;
     int size, newsize, oldsize;
-    int max_total_size = 0;
-    int total_size = 0;
+    size_t max_total_size = 0;
+    size_t total_size = 0;
     char *p;
     char *newp, *oldp;
 
@@ -711,6 +1259,18 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	app_error("mm_init failed in eval_mm_util");
 
     for (i = 0;  i < trace->num_ops;  i++) {
+	if (batching && (n = batch_run(trace, i)) > 1) {
+	    for (j = 0; j < n && trace->ops[i].type == FREE; j++)
+		total_size -= trace->block_sizes[trace->ops[i + j].index];
+	    if (!replay_batch(trace, i, n))
+		app_error("mm_malloc_batch failed in eval_mm_util");
+	    if (trace->ops[i].type == ALLOC)
+		total_size += n * trace->ops[i].size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    i += n - 1;
+	    continue;
+	}
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
@@ -733,6 +1293,21 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 		total_size : max_total_size;
 	    break;
 
+	case MEMALIGN: /* mm_memalign */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+
+	    if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+		app_error("mm_memalign failed in eval_mm_util");
+
+	    /* Remember region and size, the padding counts as wasted */
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    total_size += size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
 	case REALLOC: /* mm_realloc */
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
@@ -774,7 +1349,9 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    /* The heap may have shrunk, or memory may have been unmapped : compare
+     * with the largest footprint */
+    return ((double)max_total_size / (double)mem_peaksize());
 }
 
 
@@ -784,27 +1361,49 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size, newsize;
-    char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     /* Reset the heap and initialize the mm package */
     mem_reset_brk();
     if (mm_init() < 0) 
 	app_error("mm_init failed in eval_mm_speed");
+    replay_ops(trace, 0, trace->num_ops);
+}
+
+/*
+ * replay_ops - Replay the requests lo to hi - 1 of a trace, as fast as
+ *    possible, for eval_mm_speed and eval_mm_phase
+ */
+static void replay_ops(trace_t *trace, int lo, int hi)
+{
+    int i, n, index, size, newsize;
+    char *p, *newp, *oldp, *block;
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+    for (i = lo;  i < hi;  i++)
+	if (batching && (n = batch_run(trace, i)) > 1 && i + n <= hi) {
+	    if (!replay_batch(trace, i, n))
+		app_error("mm_malloc_batch error in eval_mm_speed");
+	    i += n - 1;
+	}
+        else switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
+            if ((p = zeroing ? mm_calloc(1, size) : mm_malloc(size)) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
 
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+		app_error("mm_memalign error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
 	case REALLOC: /* mm_realloc */
 	    index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -825,77 +1424,957 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+
 /*
- * eval_libc_valid - We run this function to make sure that the
- *    libc malloc can run to completion on the set of traces.
- *    We'll be conservative and terminate if any libc malloc call fails.
- *
+ * snapshot_take - Replay the first op requests of a trace, and take a
+ *    snapshot of the heap they leave
  */
-static int eval_libc_valid(trace_t *trace, int tracenum)
+static snapshot_t *snapshot_take(trace_t *trace, int op)
 {
-    int i, newsize;
-    char *p, *newp, *oldp;
+    snapshot_t *snap;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    if (op >= trace->num_ops)
+	app_error("-s is past the last request of the trace");
+    if ((snap = (snapshot_t *)malloc(sizeof(snapshot_t))) == NULL ||
+	(snap->mm_state = malloc(mm_snapshot_size())) == NULL ||
+	(snap->blocks = (char **)malloc(trace->num_ids * sizeof(char *))) == NULL ||
+	(snap->block_sizes = (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc failed in snapshot_take");
 
-        case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
-		malloc_error(tracenum, i, "libc malloc failed");
-		unix_error("System message");
-	    }
-	    trace->blocks[trace->ops[i].index] = p;
-	    break;
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in snapshot_take");
+    replay_ops(trace, 0, op);
+    if ((snap->mem = mem_snapshot()) == NULL)
+	unix_error("mem_snapshot failed in snapshot_take");
+    mm_snapshot(snap->mm_state);
+    memcpy(snap->blocks, trace->blocks, trace->num_ids * sizeof(char *));
+    memcpy(snap->block_sizes, trace->block_sizes, trace->num_ids * sizeof(size_t));
+    snap->first_op = op;
+    return snap;
+}
 
-	case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[trace->ops[i].index];
-	    if ((newp = realloc(oldp, newsize)) == NULL) {
-		malloc_error(tracenum, i, "libc realloc failed");
-		unix_error("System message");
-	    }
-	    trace->blocks[trace->ops[i].index] = newp;
-	    break;
-	    
-        case FREE: /* free */
-	    free(trace->blocks[trace->ops[i].index]);
-	    break;
+/*
+ * snapshot_free - Free a snapshot, the heap is then empty
+ */
+static void snapshot_free(snapshot_t *snap)
+{
+    mem_snapshot_free(snap->mem);
+    free(snap->mm_state);
+    free(snap->blocks);
+    free(snap->block_sizes);
+    free(snap);
+}
 
-	default:
-	    app_error("invalid operation type  in eval_libc_valid");
-	}
-    }
+/*
+ * eval_mm_phase - Restore the snapshot of the heap and replay the rest of
+ *    the trace from it. The pages of the heap are copied as they are
+ *    written, so a run costs the requests it replays, not the trace.
+ */
+static void eval_mm_phase(void *ptr)
+{
+    trace_t *trace = ((speed_t *)ptr)->trace;
+    snapshot_t *snap = ((speed_t *)ptr)->snap;
+
+    if (mem_restore(snap->mem) < 0)
+	app_error("mem_restore failed in eval_mm_phase");
+    mm_restore(snap->mm_state);
+    memcpy(trace->blocks, snap->blocks, trace->num_ids * sizeof(char *));
+    memcpy(trace->block_sizes, snap->block_sizes, trace->num_ids * sizeof(size_t));
+    replay_ops(trace, snap->first_op, trace->num_ops);
+}
 
-    return 1;
+/*
+ * hist_record - Count value in a latency histogram
+ */
+static inline void hist_record(hist_t *hist, unsigned long long value)
+{
+    int shift, bucket;
+
+    if (value < HIST_SUB)
+	bucket = value;
+    else {
+	shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	bucket = (shift + 1) * HIST_SUB + (int)((value >> shift) - HIST_SUB);
+    }
+    hist->counts[bucket]++;
+    hist->n++;
+    if (value > hist->max)
+	hist->max = value;
 }
 
-/* 
- * eval_libc_speed - This is the function that is used by fcyc() to
- *    measure the running time of the libc malloc package on the set
- *    of traces.
+/*
+ * hist_percentile - Returns the largest value of the bucket holding the
+ *    pct-th percentile of a histogram
  */
-static void eval_libc_speed(void *ptr)
+static unsigned long long hist_percentile(hist_t *hist, double pct)
 {
-    int i;
-    int index, size, newsize;
-    char *p, *newp, *oldp, *block;
-    trace_t *trace = ((speed_t *)ptr)->trace;
+    unsigned long long rank = (unsigned long long)(pct / 100.0 * hist->n);
+    unsigned long long seen = 0, value;
+    int bucket, shift;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
-        case ALLOC: /* malloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
-	    if ((p = malloc(size)) == NULL)
-		unix_error("malloc failed in eval_libc_speed");
-	    trace->blocks[index] = p;
+    for (bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+	seen += hist->counts[bucket];
+	if (seen > rank)
 	    break;
+    }
+    if (bucket < HIST_SUB)
+	value = bucket;
+    else {
+	shift = bucket / HIST_SUB - 1;
+	value = (((unsigned long long)(bucket % HIST_SUB + HIST_SUB + 1)) << shift) - 1;
+    }
+    return (value < hist->max) ? value : hist->max;
+}
 
-	case REALLOC: /* realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
-	    oldp = trace->blocks[index];
-	    if ((newp = realloc(oldp, newsize)) == NULL)
+/*
+ * batch_run - Number of requests, at most BATCH_MAX, in the run of allocs
+ *    of the same size or of frees that starts at request i
+ */
+static int batch_run(trace_t *trace, int i)
+{
+    traceop_t *op = &trace->ops[i];
+    int n = 1;
+
+    if (op->type != ALLOC && op->type != FREE)
+	return 1;
+    while (n < BATCH_MAX && i + n < trace->num_ops && op[n].type == op->type &&
+	   (op->type == FREE || op[n].size == op->size))
+	n++;
+    return n;
+}
+
+/*
+ * replay_batch - Replay the n requests of a run found by batch_run with
+ *    one call to mm_malloc_batch or mm_free_batch. Returns 0 if the
+ *    allocation failed.
+ */
+static int replay_batch(trace_t *trace, int i, int n)
+{
+    char *ptrs[BATCH_MAX];
+    traceop_t *op = &trace->ops[i];
+    int j;
+
+    if (op->type == FREE) {
+	for (j = 0; j < n; j++)
+	    ptrs[j] = trace->blocks[op[j].index];
+	mm_free_batch((void **)ptrs, n);
+	return 1;
+    }
+    if (mm_malloc_batch(op->size, n, (void **)ptrs) != (size_t)n)
+	return 0;
+    for (j = 0; j < n; j++) {
+	trace->blocks[op[j].index] = ptrs[j];
+	trace->block_sizes[op[j].index] = op->size;
+    }
+    return 1;
+}
+
+/*
+ * eval_mm_latency - Replay a trace once, timing every request with the
+ *    cycle counter. The replay loop records into the static histograms,
+ *    it takes no lock and allocates nothing. lat gets one summary per
+ *    request type.
+ */
+static void eval_mm_latency(trace_t *trace, latency_t *lat)
+{
+    int i, type;
+    char *p;
+    unsigned long long start, end, overhead = ~0ULL;
+
+    /* Cost of reading the counter, taken off every measure */
+    for (i = 0; i < 100; i++) {
+	start = read_counter();
+	end = read_counter();
+	if (end - start < overhead)
+	    overhead = end - start;
+    }
+    memset(hists, 0, sizeof(hists));
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	type = trace->ops[i].type;
+        switch (type) {
+
+        case ALLOC: /* mm_malloc */
+	    start = read_counter();
+            p = mm_malloc(trace->ops[i].size);
+	    end = read_counter();
+            if (p == NULL)
+		app_error("mm_malloc error in eval_mm_latency");
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+	    start = read_counter();
+            p = mm_memalign(trace->ops[i].align, trace->ops[i].size);
+	    end = read_counter();
+            if (p == NULL)
+		app_error("mm_memalign error in eval_mm_latency");
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
+	case REALLOC: /* mm_realloc */
+	    start = read_counter();
+            p = mm_realloc(trace->blocks[trace->ops[i].index], trace->ops[i].size);
+	    end = read_counter();
+            if (p == NULL)
+		app_error("mm_realloc error in eval_mm_latency");
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
+        case FREE: /* mm_free */
+	    start = read_counter();
+            mm_free(trace->blocks[trace->ops[i].index]);
+	    end = read_counter();
+            break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_latency");
+        }
+	end -= start;
+	hist_record(&hists[type], (end > overhead) ? end - overhead : 0);
+    }
+
+    for (type = 0; type < NUM_OP_TYPES; type++) {
+	lat[type].n = hists[type].n;
+	lat[type].p50 = hist_percentile(&hists[type], 50);
+	lat[type].p99 = hist_percentile(&hists[type], 99);
+	lat[type].p999 = hist_percentile(&hists[type], 99.9);
+	lat[type].max = hists[type].max;
+    }
+}
+
+/*
+ * eval_mm_locality - Replay a trace once, touching the payloads as
+ *    touch_pattern says. The accesses are timed with the cycle counter,
+ *    and the whole replay with it and the hardware counters, so that
+ *    placement is judged on the cost of the requests and of the
+ *    accesses of the application together.
+ */
+static void eval_mm_locality(trace_t *trace, locality_t *loc)
+{
+    int i, k, index, type, num_recent = 0;
+    int recent[RECENT_BLOCKS];  /* ids of the last blocks allocated */
+    int llc_fd, dtlb_fd;
+    link_t head, *cursor, *l;
+    char *p;
+    size_t size;
+    unsigned long sum = 0;
+    unsigned long long begin, start, end, accesses = 0, cycles = 0, overhead = ~0ULL;
+
+    /* Cost of reading the counter, taken off every measure */
+    for (i = 0; i < 100; i++) {
+	start = read_counter();
+	end = read_counter();
+	if (end - start < overhead)
+	    overhead = end - start;
+    }
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_locality");
+    head.next = head.prev = cursor = &head;
+    memset(trace->blocks, 0, trace->num_ids * sizeof(char *));
+
+    llc_fd = perf_open(0);
+    dtlb_fd = perf_open(1);
+    begin = read_counter();
+    for (i = 0;  i < trace->num_ops;  i++) {
+	type = trace->ops[i].type;
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+
+	/* Out of the list before its block is freed or moved */
+	if ((type == FREE || type == REALLOC) && touch_pattern == TOUCH_CHASE &&
+	    trace->block_sizes[index] >= sizeof(link_t)) {
+	    start = read_counter();
+	    l = (link_t *)trace->blocks[index];
+	    if (cursor == l)
+		cursor = l->next;
+	    l->prev->next = l->next;
+	    l->next->prev = l->prev;
+	    end = read_counter() - start;
+	    cycles += (end > overhead) ? end - overhead : 0;
+	    accesses++;
+	}
+
+        switch (type) {
+        case ALLOC: /* mm_malloc */
+            p = mm_malloc(size);
+            break;
+        case MEMALIGN: /* mm_memalign */
+            p = mm_memalign(trace->ops[i].align, size);
+            break;
+	case REALLOC: /* mm_realloc */
+            p = mm_realloc(trace->blocks[index], size);
+            break;
+        case FREE: /* mm_free */
+            mm_free(trace->blocks[index]);
+	    p = NULL;
+            break;
+	default:
+	    app_error("Nonexistent request type in eval_mm_locality");
+        }
+	if (p == NULL && type != FREE)
+	    app_error("mm_malloc error in eval_mm_locality");
+	trace->blocks[index] = p;
+	trace->block_sizes[index] = (type == FREE) ? 0 : size;
+
+	start = read_counter();
+	if (p != NULL) {
+	    /* The application fills the block, and links it in the list */
+	    if (touch_pattern == TOUCH_CHASE && size >= sizeof(link_t)) {
+		l = (link_t *)p;
+		l->next = head.next;
+		l->prev = &head;
+		head.next->prev = l;
+		head.next = l;
+		accesses += touch_write(p, size, sizeof(link_t)) + 1;
+	    }
+	    else
+		accesses += touch_write(p, size, 0);
+	    recent[num_recent++ % RECENT_BLOCKS] = index;
+	}
+
+	/* Then works on the blocks of the pattern */
+	if (touch_pattern == TOUCH_RECENT) {
+	    for (k = 0; k < RECENT_BLOCKS && k < num_recent; k++)
+		if (trace->blocks[recent[k]] != NULL)
+		    accesses += touch_read(trace->blocks[recent[k]],
+					   trace->block_sizes[recent[k]], &sum);
+	}
+	else if (head.next != &head) {
+	    for (k = 0; k < CHASE_HOPS; k++) {
+		cursor = cursor->next;
+		if (cursor == &head)
+		    cursor = head.next;
+		sum += (uintptr_t)cursor->prev;
+	    }
+	    accesses += CHASE_HOPS;
+	}
+	end = read_counter() - start;
+	cycles += (end > overhead) ? end - overhead : 0;
+    }
+    loc->total = read_counter() - begin;
+    loc->llc_misses = perf_stop(llc_fd);
+    loc->dtlb_misses = perf_stop(dtlb_fd);
+
+    /* Keeps the reads from being optimized away */
+    touch_sink = sum;
+    loc->ops = trace->num_ops;
+    loc->accesses = accesses;
+    loc->cycles = cycles;
+}
+
+/*
+ * touch_write - Write the first byte of each line of a payload, at most
+ *    TOUCH_MAX_LINES, past its first skip bytes. Returns the lines written.
+ */
+static int touch_write(char *p, size_t size, size_t skip)
+{
+    char *q = p + skip;
+    char *end = p + (size < TOUCH_MAX_LINES * TOUCH_LINE ? size : TOUCH_MAX_LINES * TOUCH_LINE);
+    int n;
+
+    for (n = 0; q < end; n++) {
+	*q = (char)n;
+	q = (char *)(((uintptr_t)q | (TOUCH_LINE - 1)) + 1);
+    }
+    return n;
+}
+
+/*
+ * touch_read - Read the first byte of each line of a payload, at most
+ *    TOUCH_MAX_LINES, into *sum. Returns the lines read.
+ */
+static int touch_read(char *p, size_t size, unsigned long *sum)
+{
+    char *end = p + (size < TOUCH_MAX_LINES * TOUCH_LINE ? size : TOUCH_MAX_LINES * TOUCH_LINE);
+    int n;
+
+    for (n = 0; p < end; n++) {
+	*sum += *(volatile char *)p;
+	p = (char *)(((uintptr_t)p | (TOUCH_LINE - 1)) + 1);
+    }
+    return n;
+}
+
+/*
+ * perf_open - Start counting the read misses of the last level cache, or
+ *    of the data TLB if dtlb is set, in this process. Returns -1 if the
+ *    system can't count them.
+ */
+static int perf_open(int dtlb)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = (dtlb ? PERF_COUNT_HW_CACHE_DTLB : PERF_COUNT_HW_CACHE_LL) |
+	(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    if ((fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0)) < 0)
+	return -1;
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * perf_stop - Stop a counter of perf_open, and return its count, or -1
+ */
+static long long perf_stop(int fd)
+{
+    long long count = -1;
+
+#ifdef __linux__
+    if (fd < 0)
+	return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+	count = -1;
+    close(fd);
+#endif
+    return count;
+}
+
+/*
+ * eval_mm_stream - Replay a trace once, one chunk at a time, measuring its
+ *    space utilization and running time together. Only the id tables,
+ *    sized from the header, and two chunks of ops are in memory, and the
+ *    number of ops in the header is not trusted. The correctness checks
+ *    of eval_mm_valid are not done.
+ */
+static void eval_mm_stream(char *tracedir, char *filename, int tracenum, stats_t *stats)
+{
+    stream_t stream;
+    trace_header_t header;
+    pthread_t reader;
+    char path[MAXLINE];
+    char **blocks;
+    size_t *block_sizes;
+    size_t total_size = 0, max_total_size = 0;
+    double ops = 0;
+    int i, n, buf = 0;
+    traceop_t *op;
+    char *p;
+    struct timeval start, end;
+
+    strcpy(path, tracedir);
+    strcat(path, filename);
+    if (verbose > 1)
+	printf("Streaming tracefile: %s\n", path);
+    if ((stream.file = fopen(path, "r")) == NULL) {
+	sprintf(msg, "Could not open %s in eval_mm_stream", path);
+	unix_error(msg);
+    }
+    stream.path = path;
+
+    /* Read the header, binary or text */
+    if (fread(&header, sizeof(header), 1, stream.file) == 1 && header.magic == TRACE_MAGIC) {
+	if (header.version != TRACE_VERSION || header.opsize != sizeof(traceop_t)) {
+	    sprintf(msg, "%s is not a binary trace for this machine", path);
+	    app_error(msg);
+	}
+	stream.binary = 1;
+    }
+    else {
+	rewind(stream.file);
+	if (fscanf(stream.file, "%d %d %d %d", &header.sugg_heapsize, &header.num_ids,
+		   &header.num_ops, &header.weight) != 4) {
+	    sprintf(msg, "Bad header in %s", path);
+	    app_error(msg);
+	}
+	stream.binary = 0;
+    }
+
+    if ((blocks = (char **)calloc(header.num_ids, sizeof(char *))) == NULL ||
+	(block_sizes = (size_t *)calloc(header.num_ids, sizeof(size_t))) == NULL ||
+	(stream.bufs[0] = (traceop_t *)malloc(2 * STREAM_CHUNK * sizeof(traceop_t))) == NULL)
+	unix_error("malloc failed in eval_mm_stream");
+    stream.bufs[1] = stream.bufs[0] + STREAM_CHUNK;
+    stream.ready[0] = stream.ready[1] = 0;
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.cond, NULL);
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_stream");
+
+    if (pthread_create(&reader, NULL, stream_reader, &stream) != 0)
+	unix_error("pthread_create failed in eval_mm_stream");
+    gettimeofday(&start, NULL);
+    for (;;) {
+	/* Wait for the reader to fill the next buffer */
+	pthread_mutex_lock(&stream.lock);
+	while (!stream.ready[buf])
+	    pthread_cond_wait(&stream.cond, &stream.lock);
+	pthread_mutex_unlock(&stream.lock);
+	if ((n = stream.counts[buf]) == 0)
+	    break;
+
+	for (i = 0, op = stream.bufs[buf]; i < n; i++, op++) {
+	    if (op->index < 0 || op->index >= header.num_ids) {
+		malloc_error(tracenum, (int)ops + i, "request id out of range");
+		app_error("eval_mm_stream aborted");
+	    }
+	    switch (op->type) {
+
+	    case ALLOC: /* mm_malloc */
+		if ((p = mm_malloc(op->size)) == NULL)
+		    app_error("mm_malloc error in eval_mm_stream");
+		blocks[op->index] = p;
+		block_sizes[op->index] = op->size;
+		total_size += op->size;
+		break;
+
+	    case MEMALIGN: /* mm_memalign */
+		if ((p = mm_memalign(op->align, op->size)) == NULL)
+		    app_error("mm_memalign error in eval_mm_stream");
+		blocks[op->index] = p;
+		block_sizes[op->index] = op->size;
+		total_size += op->size;
+		break;
+
+	    case REALLOC: /* mm_realloc */
+		if ((p = mm_realloc(blocks[op->index], op->size)) == NULL)
+		    app_error("mm_realloc error in eval_mm_stream");
+		blocks[op->index] = p;
+		total_size += op->size - block_sizes[op->index];
+		block_sizes[op->index] = op->size;
+		break;
+
+	    case FREE: /* mm_free */
+		mm_free(blocks[op->index]);
+		total_size -= block_sizes[op->index];
+		break;
+
+	    default:
+		app_error("Nonexistent request type in eval_mm_stream");
+	    }
+	    if (heap_check && (p = mm_check_step()) != NULL) {
+		sprintf(msg, "heap check failed at %p", p);
+		malloc_error(tracenum, (int)ops + i, msg);
+		app_error("eval_mm_stream aborted");
+	    }
+	    max_total_size = (total_size > max_total_size) ? total_size : max_total_size;
+	}
+	ops += n;
+
+	/* Give the buffer back to the reader */
+	pthread_mutex_lock(&stream.lock);
+	stream.ready[buf] = 0;
+	pthread_cond_signal(&stream.cond);
+	pthread_mutex_unlock(&stream.lock);
+	buf ^= 1;
+    }
+    gettimeofday(&end, NULL);
+    pthread_join(reader, NULL);
+
+    stats->ops = ops;
+    stats->valid = 1;
+    stats->secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    stats->util = (double)max_total_size / (double)mem_peaksize();
+
+    fclose(stream.file);
+    pthread_mutex_destroy(&stream.lock);
+    pthread_cond_destroy(&stream.cond);
+    free(stream.bufs[0]);
+    free(blocks);
+    free(block_sizes);
+}
+
+/*
+ * stream_reader - Reader thread of eval_mm_stream : fills the two buffers
+ *    in turn, and marks the end of the trace with an empty buffer
+ */
+static void *stream_reader(void *arg)
+{
+    stream_t *stream = (stream_t *)arg;
+    int buf = 0, n;
+
+    do {
+	/* Wait for the replay to be done with this buffer */
+	pthread_mutex_lock(&stream->lock);
+	while (stream->ready[buf])
+	    pthread_cond_wait(&stream->cond, &stream->lock);
+	pthread_mutex_unlock(&stream->lock);
+
+	n = stream_read_chunk(stream, stream->bufs[buf]);
+
+	pthread_mutex_lock(&stream->lock);
+	stream->counts[buf] = n;
+	stream->ready[buf] = 1;
+	pthread_cond_signal(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+	buf ^= 1;
+    } while (n > 0);
+    return NULL;
+}
+
+/*
+ * stream_read_chunk - Read up to STREAM_CHUNK ops of a trace into buf,
+ *     returns how many were read
+ */
+static int stream_read_chunk(stream_t *stream, traceop_t *buf)
+{
+    char type[MAXLINE];
+    unsigned index, size, align;
+    int n = 0;
+
+    if (stream->binary)
+	return fread(buf, sizeof(traceop_t), STREAM_CHUNK, stream->file);
+
+    while (n < STREAM_CHUNK && fscanf(stream->file, "%s", type) != EOF) {
+	switch(type[0]) {
+	case 'a':
+	case 'r':
+	    fscanf(stream->file, "%u %u", &index, &size);
+	    buf[n].type = (type[0] == 'a') ? ALLOC : REALLOC;
+	    buf[n].size = size;
+	    break;
+	case 'm':
+	    fscanf(stream->file, "%u %u %u", &index, &size, &align);
+	    buf[n].type = MEMALIGN;
+	    buf[n].size = size;
+	    buf[n].align = align;
+	    break;
+	case 'f':
+	    fscanf(stream->file, "%u", &index);
+	    buf[n].type = FREE;
+	    break;
+	default:
+	    printf("Bogus type character (%c) in tracefile %s\n", 
+		   type[0], stream->path);
+	    exit(1);
+	}
+	buf[n].index = index;
+	n++;
+    }
+    return n;
+}
+
+/*
+ * eval_mm_threads - Replay every trace on num_threads threads at once and
+ *    print the per-thread and aggregate throughput, then the aggregate
+ *    throughput for 1, 2, 4... threads up to num_threads
+ */
+static void eval_mm_threads(char **tracefiles, int num_tracefiles)
+{
+    int i, j, n;
+    trace_t **traces;
+    double *thread_secs, secs, ops, total_secs, total_ops, base_kops = 0;
+
+    if ((traces = (trace_t **)malloc(num_tracefiles * sizeof(trace_t *))) == NULL ||
+	(thread_secs = (double *)malloc(num_threads * sizeof(double))) == NULL)
+	unix_error("malloc failed in eval_mm_threads");
+    for (i = 0; i < num_tracefiles; i++)
+	traces[i] = read_trace(tracedir, tracefiles[i]);
+
+    /* Per-thread results, with all the threads */
+    printf("\nResults for mm malloc on %d threads, %d%% of frees on another thread:\n",
+	   num_threads, handoff_pct);
+    printf("%5s  %-*s%10s\n", "trace", 7 * num_threads, " Kops per thread", "total Kops");
+    total_secs = 0;
+    total_ops = 0;
+    for (i = 0; i < num_tracefiles; i++) {
+	secs = eval_mm_mt(traces[i], num_threads, thread_secs);
+	ops = (double)traces[i]->num_ops * num_threads;
+	printf("%2d   ", i);
+	for (j = 0; j < num_threads; j++)
+	    printf("%7.0f", (traces[i]->num_ops / 1e3) / thread_secs[j]);
+	printf("%10.0f\n", (ops / 1e3) / secs);
+	total_secs += secs;
+	total_ops += ops;
+    }
+    printf("%-*s%10.0f\n", 5 + 7 * num_threads, "Total", (total_ops / 1e3) / total_secs);
+
+    /* Scaling curve, over all the traces */
+    printf("\nScaling of mm malloc:\n");
+    printf("%7s%10s%10s%8s\n", "threads", "secs", "Kops", "speedup");
+    for (n = 1; ; n = (2 * n < num_threads) ? 2 * n : num_threads) {
+	total_secs = 0;
+	total_ops = 0;
+	for (i = 0; i < num_tracefiles; i++) {
+	    total_secs += eval_mm_mt(traces[i], n, thread_secs);
+	    total_ops += (double)traces[i]->num_ops * n;
+	}
+	if (n == 1)
+	    base_kops = (total_ops / 1e3) / total_secs;
+	printf("%7d%10.6f%10.0f%7.2fx\n", n, total_secs, (total_ops / 1e3) / total_secs,
+	       ((total_ops / 1e3) / total_secs) / base_kops);
+	if (n == num_threads)
+	    break;
+    }
+    printf("\n");
+
+    for (i = 0; i < num_tracefiles; i++)
+	free_trace(traces[i]);
+    free(traces);
+    free(thread_secs);
+}
+
+/*
+ * eval_mm_mt - Replay a trace on nthreads threads at once, each with its
+ *    own blocks. Returns the wall clock time, and the time of each thread
+ *    in thread_secs.
+ */
+static double eval_mm_mt(trace_t *trace, int nthreads, double *thread_secs)
+{
+    int i;
+    pthread_t *tids;
+    mt_thread_t *threads;
+    ring_t *rings;
+    struct timeval start, end;
+
+    tids = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    threads = (mt_thread_t *)calloc(nthreads, sizeof(mt_thread_t));
+    rings = (ring_t *)calloc(nthreads, sizeof(ring_t));
+    if (tids == NULL || threads == NULL || rings == NULL)
+	unix_error("malloc failed in eval_mm_mt");
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_mt");
+
+    pthread_barrier_init(&mt_barrier, NULL, nthreads + 1);
+    pthread_barrier_init(&mt_done, NULL, nthreads);
+    for (i = 0; i < nthreads; i++) {
+	threads[i].trace = trace;
+	threads[i].id = i;
+	threads[i].nthreads = nthreads;
+	if ((threads[i].blocks = (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
+	    unix_error("malloc failed in eval_mm_mt");
+	threads[i].inbox = &rings[i];
+	threads[i].outbox = (nthreads > 1) ? &rings[(i + 1) % nthreads] : NULL;
+	if (pthread_create(&tids[i], NULL, mt_replay, &threads[i]) != 0)
+	    unix_error("pthread_create failed in eval_mm_mt");
+    }
+    pthread_barrier_wait(&mt_barrier);
+    gettimeofday(&start, NULL);
+    for (i = 0; i < nthreads; i++)
+	pthread_join(tids[i], NULL);
+    gettimeofday(&end, NULL);
+    pthread_barrier_destroy(&mt_barrier);
+    pthread_barrier_destroy(&mt_done);
+
+    for (i = 0; i < nthreads; i++) {
+	thread_secs[i] = threads[i].secs;
+	free(threads[i].blocks);
+    }
+    free(tids);
+    free(threads);
+    free(rings);
+    return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+}
+
+/*
+ * mt_replay - Thread of the -T mode : replays its trace, handing
+ *    handoff_pct% of its frees to the next thread, and frees the blocks
+ *    the previous thread hands to it
+ */
+static void *mt_replay(void *arg)
+{
+    mt_thread_t *t = (mt_thread_t *)arg;
+    trace_t *trace = t->trace;
+    unsigned seed = t->id + 1;
+    int i, index;
+    char *p;
+    struct timeval start, end;
+
+    pthread_barrier_wait(&mt_barrier);
+    gettimeofday(&start, NULL);
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+            if ((p = mm_malloc(trace->ops[i].size)) == NULL)
+		app_error("mm_malloc error in mt_replay");
+            t->blocks[index] = p;
+            break;
+
+        case MEMALIGN: /* mm_memalign */
+            if ((p = mm_memalign(trace->ops[i].align, trace->ops[i].size)) == NULL)
+		app_error("mm_memalign error in mt_replay");
+            t->blocks[index] = p;
+            break;
+
+	case REALLOC: /* mm_realloc */
+            if ((p = mm_realloc(t->blocks[index], trace->ops[i].size)) == NULL)
+		app_error("mm_realloc error in mt_replay");
+            t->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free, here or on the next thread */
+	    p = t->blocks[index];
+	    t->blocks[index] = NULL;
+	    if (t->outbox == NULL || rand_r(&seed) % 100 >= handoff_pct ||
+		!ring_push(t->outbox, p))
+		mm_free(p);
+            break;
+
+	default:
+	    app_error("Nonexistent request type in mt_replay");
+        }
+	ring_drain(t->inbox);
+    }
+
+    /* Free what the trace left */
+    for (i = 0; i < trace->num_ids; i++)
+	if (t->blocks[i] != NULL)
+	    mm_free(t->blocks[i]);
+    gettimeofday(&end, NULL);
+    t->secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+
+    /* 
+     * Then what the others still hand to us, once none of them can push:
+     * the wait blocks instead of taking the CPU of the threads still
+     * replaying, and isn't counted in the time of this thread
+     */
+    pthread_barrier_wait(&mt_done);
+    ring_drain(t->inbox);
+    return NULL;
+}
+
+/*
+ * ring_push - Hand a block to the consumer of a ring, returns 0 if it is full
+ */
+static int ring_push(ring_t *ring, char *p)
+{
+    unsigned tail = ring->tail;
+
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RING_SIZE)
+	return 0;
+    ring->slots[tail % RING_SIZE] = p;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * ring_drain - Free every block handed through a ring
+ */
+static void ring_drain(ring_t *ring)
+{
+    unsigned head = ring->head;
+    unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail)
+	return;
+    while (head != tail)
+	mm_free(ring->slots[head++ % RING_SIZE]);
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * eval_libc_valid - We run this function to make sure that the
+ *    libc malloc (or another allocator with its interface) can run
+ *    to completion on the set of traces.
+ *    We'll be conservative and terminate if any libc malloc call fails.
+ *
+ */
+static int eval_libc_valid(allocator_t *alloc, trace_t *trace, int tracenum)
+{
+    int i, newsize;
+    char *p, *newp, *oldp;
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* malloc */
+	    if ((p = alloc->malloc_fn(trace->ops[i].size)) == NULL) {
+		malloc_error(tracenum, i, "libc malloc failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
+        case MEMALIGN: /* posix_memalign */
+	    if (alloc->memalign_fn == NULL) {
+		printf("%s has no posix_memalign\n", alloc->name);
+		return 0;
+	    }
+	    if (alloc->memalign_fn((void **)&p, trace->ops[i].align,
+				   trace->ops[i].size) != 0) {
+		malloc_error(tracenum, i, "libc posix_memalign failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
+	case REALLOC: /* realloc */
+            newsize = trace->ops[i].size;
+	    oldp = trace->blocks[trace->ops[i].index];
+	    if ((newp = alloc->realloc_fn(oldp, newsize)) == NULL) {
+		malloc_error(tracenum, i, "libc realloc failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = newp;
+	    break;
+	    
+        case FREE: /* free */
+	    alloc->free_fn(trace->blocks[trace->ops[i].index]);
+	    break;
+
+	default:
+	    app_error("invalid operation type  in eval_libc_valid");
+	}
+    }
+
+    return 1;
+}
+
+/* 
+ * eval_libc_speed - This is the function that is used by fcyc() to
+ *    measure the running time of the libc malloc package on the set
+ *    of traces.
+ */
+static void eval_libc_speed(void *ptr)
+{
+    int i;
+    int index, size, newsize;
+    char *p, *newp, *oldp, *block;
+    trace_t *trace = ((speed_t *)ptr)->trace;
+    allocator_t *alloc = ((speed_t *)ptr)->alloc;
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        switch (trace->ops[i].type) {
+        case ALLOC: /* malloc */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    if ((p = alloc->malloc_fn(size)) == NULL)
+		unix_error("malloc failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    break;
+
+        case MEMALIGN: /* posix_memalign */
+	    index = trace->ops[i].index;
+	    if (alloc->memalign_fn((void **)&p, trace->ops[i].align,
+				   trace->ops[i].size) != 0)
+		unix_error("posix_memalign failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    break;
+
+	case REALLOC: /* realloc */
+	    index = trace->ops[i].index;
+	    newsize = trace->ops[i].size;
+	    oldp = trace->blocks[index];
+	    if ((newp = alloc->realloc_fn(oldp, newsize)) == NULL)
 		unix_error("realloc failed in eval_libc_speed\n");
 	    
 	    trace->blocks[index] = newp;
@@ -904,7 +2383,7 @@ static void eval_libc_speed(void *ptr)
         case FREE: /* free */
 	    index = trace->ops[i].index;
 	    block = trace->blocks[index];
-	    free(block);
+	    alloc->free_fn(block);
 	    break;
 	}
     }
@@ -925,18 +2404,25 @@ static void printresults(int n, stats_t *stats)
     double ops = 0;
     double util = 0;
 
-    /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
+    /* Print the individual results for each trace, with the confidence
+     * interval of secs if they were timed over several runs (-r) */
+    printf("%5s%7s %5s%8s%10s%6s", 
 	   "trace", " valid", "util", "ops", "secs", "Kops");
+    if (num_runs > 1)
+	printf("%11s", "+-secs");
+    printf("\n");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
 		   stats[i].ops,
 		   stats[i].secs,
 		   (stats[i].ops/1e3)/stats[i].secs);
+	    if (num_runs > 1)
+		printf("%11.6f", stats[i].secs_ci);
+	    printf("\n");
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
@@ -972,6 +2458,271 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printlatency - prints the latency percentiles of each request type
+ *    for each trace, as measured by eval_mm_latency
+ */
+static void printlatency(int n, latency_t *lat)
+{
+    static char *names[NUM_OP_TYPES];
+    int i, type;
+
+    names[ALLOC] = "malloc";
+    names[FREE] = "free";
+    names[REALLOC] = "realloc";
+    names[MEMALIGN] = "memalign";
+    printf("Latency of mm malloc, in cycles:\n");
+    printf("%5s %8s%9s%8s%8s%8s%10s\n", 
+	   "trace", "request", "count", "p50", "p99", "p99.9", "max");
+    for (i = 0; i < n; i++) {
+	for (type = 0; type < NUM_OP_TYPES; type++) {
+	    if (lat[NUM_OP_TYPES * i + type].n == 0)
+		continue;
+	    printf("%2d    %8s%9llu%8llu%8llu%8llu%10llu\n", 
+		   i,
+		   names[type],
+		   lat[NUM_OP_TYPES * i + type].n,
+		   lat[NUM_OP_TYPES * i + type].p50,
+		   lat[NUM_OP_TYPES * i + type].p99,
+		   lat[NUM_OP_TYPES * i + type].p999,
+		   lat[NUM_OP_TYPES * i + type].max);
+	}
+    }
+    printf("\n");
+}
+
+/*
+ * printlocality - Print the locality of the blocks for each trace : the
+ *    cycles per access, the cycles per request with the accesses, and
+ *    the misses per thousand accesses
+ */
+static void printlocality(int n, locality_t *loc)
+{
+    int i;
+    char llc[32], dtlb[32];
+
+    printf("Locality of mm malloc, -m %s:\n", touch_pattern == TOUCH_CHASE ? "chase" : "recent");
+    printf("%5s %11s%9s%9s%11s%11s\n", 
+	   "trace", "accesses", "cyc/acc", "cyc/op", "LLC/Kacc", "dTLB/Kacc");
+    for (i = 0; i < n; i++) {
+	if (loc[i].ops == 0 || loc[i].accesses == 0)
+	    continue;
+	strcpy(llc, "n/a");
+	strcpy(dtlb, "n/a");
+	if (loc[i].llc_misses >= 0)
+	    sprintf(llc, "%.2f", loc[i].llc_misses * 1000.0 / loc[i].accesses);
+	if (loc[i].dtlb_misses >= 0)
+	    sprintf(dtlb, "%.2f", loc[i].dtlb_misses * 1000.0 / loc[i].accesses);
+	printf("%2d    %11llu%9.1f%9.1f%11s%11s\n", 
+	       i,
+	       loc[i].accesses,
+	       (double)loc[i].cycles / loc[i].accesses,
+	       (double)loc[i].total / loc[i].ops,
+	       llc,
+	       dtlb);
+    }
+    printf("\n");
+}
+
+/*
+ * time_trace - times a trace with fsecs num_runs times (-r), each run
+ *    being the K-best measurement of fcyc, and returns their mean. The
+ *    half width of its 95% confidence interval goes in *ci, from the
+ *    Student t distribution with num_runs-1 degrees of freedom.
+ */
+static double time_trace(fsecs_test_funct f, speed_t *params, double *ci)
+{
+    static const double t975[] = {
+	12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+	2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+	2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    double sum = 0, sumsq = 0, mean, var, t;
+    int i;
+
+    for (i = 0; i < num_runs; i++) {
+	double secs = fsecs(f, params);
+	sum += secs;
+	sumsq += secs * secs;
+    }
+    mean = sum / num_runs;
+    *ci = 0;
+    if (num_runs > 1) {
+	var = (sumsq - num_runs * mean * mean) / (num_runs - 1);
+	t = num_runs - 1 <= 30 ? t975[num_runs - 2] : 1.96;
+	*ci = var > 0 ? t * sqrt(var / num_runs) : 0;
+    }
+    return mean;
+}
+
+/*
+ * add_allocator - adds an allocator to run beside the mm package : libc
+ *    if path is NULL, otherwise the malloc, free, realloc and
+ *    posix_memalign of the shared library at path, named after its file
+ */
+static void add_allocator(char *name, char *path)
+{
+    allocator_t *alloc;
+    void *handle;
+
+    if (num_allocators == MAX_ALLOCATORS)
+	app_error("too many allocators to compare");
+    alloc = &allocators[num_allocators++];
+    if (path == NULL) {
+	alloc->name = name;
+	alloc->malloc_fn = malloc;
+	alloc->free_fn = free;
+	alloc->realloc_fn = realloc;
+	alloc->memalign_fn = posix_memalign;
+	return;
+    }
+
+    if ((handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+	printf("%s\n", dlerror());
+	exit(1);
+    }
+    alloc->name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    alloc->malloc_fn = (void *(*)(size_t))dlsym(handle, "malloc");
+    alloc->free_fn = (void (*)(void *))dlsym(handle, "free");
+    alloc->realloc_fn = (void *(*)(void *, size_t))dlsym(handle, "realloc");
+    alloc->memalign_fn = (int (*)(void **, size_t, size_t))dlsym(handle, "posix_memalign");
+    if (!alloc->malloc_fn || !alloc->free_fn || !alloc->realloc_fn) {
+	printf("%s does not export malloc, free and realloc\n", path);
+	exit(1);
+    }
+}
+
+/*
+ * printcompare - prints the throughput of the mm package beside the
+ *    one of each other allocator, trace by trace
+ */
+static void printcompare(int n, stats_t *mm_stats)
+{
+    int i, j;
+
+    printf("Throughput in Kops, mm malloc beside the other allocators:\n");
+    printf("%5s%10s", "trace", "mm");
+    for (j = 0; j < num_allocators; j++)
+	printf("%12.11s", allocators[j].name);
+    printf("\n");
+    for (i = 0; i < n; i++) {
+	printf("%2d   ", i);
+	if (mm_stats[i].valid)
+	    printf("%10.0f", (mm_stats[i].ops/1e3)/mm_stats[i].secs);
+	else
+	    printf("%10s", "-");
+	for (j = 0; j < num_allocators; j++) {
+	    stats_t *stats = &allocators[j].stats[i];
+	    if (stats->valid)
+		printf("%12.0f", (stats->ops/1e3)/stats->secs);
+	    else
+		printf("%12s", "-");
+	}
+	printf("\n");
+    }
+    printf("\n");
+}
+
+/*
+ * writeresult - writes the results of one allocator on one trace, as a
+ *    CSV line or a JSON object
+ */
+static void writeresult(FILE *fp, int json, char *name, char *trace, stats_t *stats)
+{
+    double kops = stats->valid ? (stats->ops/1e3)/stats->secs : 0;
+
+    if (json)
+	fprintf(fp, "    {\"allocator\": \"%s\", \"trace\": \"%s\", \"valid\": %s, "
+		"\"util\": %.4f, \"ops\": %.0f, \"secs\": %.9f, "
+		"\"secs_ci\": %.9f, \"kops\": %.1f}",
+		name, trace, stats->valid ? "true" : "false", stats->util,
+		stats->ops, stats->secs, stats->secs_ci, kops);
+    else
+	fprintf(fp, "%s,%s,%d,%.4f,%.0f,%.9f,%.9f,%.1f\n",
+		name, trace, stats->valid, stats->util,
+		stats->ops, stats->secs, stats->secs_ci, kops);
+}
+
+/*
+ * writeresults - writes the per-trace results of the mm package and of
+ *    the other allocators to path (-o), as JSON if its name ends with
+ *    ".json" and as CSV otherwise. checkbaseline reads the CSV back.
+ */
+static void writeresults(char *path, char **tracefiles, int n, stats_t *mm_stats)
+{
+    size_t len = strlen(path);
+    int json = len >= 5 && !strcmp(path + len - 5, ".json");
+    int i, j, first = 1;
+    FILE *fp;
+
+    if ((fp = fopen(path, "w")) == NULL)
+	unix_error("Could not open the output file");
+    if (json)
+	fprintf(fp, "{\n  \"runs\": %d,\n  \"results\": [\n", num_runs);
+    else
+	fprintf(fp, "allocator,trace,valid,util,ops,secs,secs_ci,kops\n");
+    for (j = -1; j < num_allocators; j++) {
+	for (i = 0; i < n; i++) {
+	    if (json && !first)
+		fprintf(fp, ",\n");
+	    first = 0;
+	    if (j < 0)
+		writeresult(fp, json, "mm", tracefiles[i], &mm_stats[i]);
+	    else
+		writeresult(fp, json, allocators[j].name, tracefiles[i],
+			    &allocators[j].stats[i]);
+	}
+    }
+    if (json)
+	fprintf(fp, "\n  ]\n}\n");
+    fclose(fp);
+}
+
+/*
+ * checkbaseline - compares the results of the mm package with the "mm"
+ *    lines of a CSV file written by -o. Prints each trace whose util or
+ *    throughput dropped by more than tolerance percent, or which is no
+ *    longer valid, and returns the number of them.
+ */
+static int checkbaseline(char *path, char **tracefiles, int n, stats_t *mm_stats)
+{
+    char line[MAXLINE], name[MAXLINE], trace[MAXLINE];
+    double util, ops, secs, secs_ci, kops, limit = 1 - tolerance / 100;
+    int i, valid, regressions = 0;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL)
+	unix_error("Could not open the baseline file");
+    while (fgets(line, MAXLINE, fp)) {
+	if (sscanf(line, "%[^,],%[^,],%d,%lf,%lf,%lf,%lf,%lf", name, trace,
+		   &valid, &util, &ops, &secs, &secs_ci, &kops) != 8 ||
+	    strcmp(name, "mm"))
+	    continue;
+	for (i = 0; i < n && strcmp(tracefiles[i], trace); i++)
+	    ;
+	if (i == n || !valid)
+	    continue;
+	if (!mm_stats[i].valid) {
+	    printf("REGRESSION [%s]: no longer valid\n", trace);
+	    regressions++;
+	    continue;
+	}
+	if (mm_stats[i].util < util * limit) {
+	    printf("REGRESSION [%s]: util %.1f%% < %.1f%% in the baseline\n",
+		   trace, mm_stats[i].util * 100, util * 100);
+	    regressions++;
+	}
+	if ((mm_stats[i].ops/1e3)/mm_stats[i].secs < kops * limit) {
+	    printf("REGRESSION [%s]: %.0f Kops < %.0f Kops in the baseline\n",
+		   trace, (mm_stats[i].ops/1e3)/mm_stats[i].secs, kops);
+	    regressions++;
+	}
+    }
+    fclose(fp);
+    if (regressions == 0)
+	printf("No regression from %s (tolerance %g%%)\n", path, tolerance);
+    return regressions;
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -1004,14 +2755,30 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvVabclLSz] [-f <file>] [-t <dir>] [-T <threads>] [-p <pct>]\n");
+    fprintf(stderr, "               [-r <runs>] [-o <file>] [-B <file>] [-x <pct>] [-A <lib.so>]\n");
+    fprintf(stderr, "               [-m recent|chase] [-s <op>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-A <lib>   Run the malloc of shared library <lib> as well.\n");
+    fprintf(stderr, "\t-b         Replay runs of allocs or frees with the batch calls.\n");
+    fprintf(stderr, "\t-B <file>  Fail if the results regressed from those of <file>.\n");
+    fprintf(stderr, "\t-c         Check the heap incrementally after each request.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Print the latency percentiles of each request type.\n");
+    fprintf(stderr, "\t-m <pat>   Touch the payloads (recent or chase), and print their locality.\n");
+    fprintf(stderr, "\t-o <file>  Write the per-trace results to <file>, CSV or .json.\n");
+    fprintf(stderr, "\t-p <pct>   With -T, hand pct%% of the frees to another thread.\n");
+    fprintf(stderr, "\t-r <n>     Time each trace n times, with 95%% confidence intervals.\n");
+    fprintf(stderr, "\t-s <op>    Time the traces from request op on, restoring a snapshot of the heap.\n");
+    fprintf(stderr, "\t-S         Stream the traces in chunks, without the correctness checks.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Also replay the traces on n threads at once.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
+    fprintf(stderr, "\t-x <pct>   Regression tolerated by -B, in percent (default 5).\n");
+    fprintf(stderr, "\t-z         Replay the allocs with mm_calloc, and check they are zero.\n");
 }
@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE     /* mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,28 +11,167 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/*
+ * Huge pages : with MEM_HUGEPAGES 0 the system picks the pages, with 1
+ * the heap and the large mappings are aligned to MEM_HUGEPAGE and the
+ * system is asked to back them with transparent huge pages, with 2 the
+ * large mappings also try explicit huge pages (see /proc/sys/vm/nr_hugepages)
+ * first. The heap can't take explicit ones : a MAP_FIXED mapping that
+ * fails may leave a hole in it.
+ */
+#ifndef MEM_HUGEPAGES
+#define MEM_HUGEPAGES 1
+#endif
+#define MEM_HUGEPAGE ((size_t)2 << 20)
+#define HUGE_ALIGN(p) (((uintptr_t)(p) + MEM_HUGEPAGE - 1) & ~(uintptr_t)(MEM_HUGEPAGE - 1))
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0   /* the address is then a hint, checked after */
+#endif
+
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_fresh_brk;  /* highest brk so far, the heap is zero past it */
+static char *mem_dirty_brk;  /* highest brk since pages were last released */
+static size_t mem_peak;      /* largest heap size plus mapped bytes so far */
+
+/* 
+ * Regions mapped with mem_mmap, so that the driver can tell if a payload
+ * lies in one of them. The list is behind a spin lock, since threads may
+ * map and unmap memory concurrently.
+ */
+typedef struct mapping {
+    char *lo;
+    size_t size;
+    size_t length;      /* bytes mapped, more than size for huge pages */
+    struct mapping *next;
+} mapping_t;
+static mapping_t *mem_mappings;
+static mapping_t *mem_free_nodes; /* unused list nodes */
+static size_t mem_mapped;    /* bytes currently mapped with mem_mmap */
+static char mem_map_lock;
+#define MAP_LOCK() while (__atomic_test_and_set(&mem_map_lock, __ATOMIC_ACQUIRE))
+#define MAP_UNLOCK() __atomic_clear(&mem_map_lock, __ATOMIC_RELEASE)
+
+/*
+ * Snapshot of the memory (see mem_snapshot) : the heap and the regions,
+ * copied to a file one after the other, in whole pages
+ */
+struct mem_snapshot {
+    int fd;
+    size_t heap_size;       /* bytes of the heap */
+    size_t heap_length;     /* ... rounded up to a page, the first bytes of the file */
+    size_t peak;
+    int num_maps;
+    mapping_t *maps;        /* the regions, their next field unused */
+    off_t *offsets;         /* where each region is in the file */
+};
+
+/*
+ * mem_new_node - returns an unused list node, the caller holds the map
+ *    lock. Nodes are carved out of pages of their own rather than taken
+ *    from malloc, which may be the mm package itself (see mmshim.c).
+ */
+static mapping_t *mem_new_node(void)
+{
+    mapping_t *m = mem_free_nodes;
+    size_t i, n = mem_pagesize() / sizeof(mapping_t);
+
+    if (m == NULL) {
+	m = mmap(NULL, mem_pagesize(), PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED)
+	    return NULL;
+	for (i = 0; i < n - 1; i++)
+	    m[i].next = &m[i + 1];
+	m[n - 1].next = NULL;
+    }
+    mem_free_nodes = m->next;
+    return m;
+}
+
+/*
+ * mem_update_peak - remember the largest memory footprint, the caller
+ *    holds the map lock
+ */
+static void mem_update_peak(void)
+{
+    size_t size = (size_t)(mem_brk - mem_start_brk) + mem_mapped;
+    if (size > mem_peak)
+	mem_peak = size;
+}
+
+/*
+ * mem_advise - asks the system for huge pages on lo:lo+size
+ */
+static void mem_advise(char *lo, size_t size)
+{
+#if MEM_HUGEPAGES && defined(MADV_HUGEPAGE)
+    madvise(lo, size, MADV_HUGEPAGE);
+#endif
+}
+
+/*
+ * mem_map_aligned - maps size bytes starting on a MEM_HUGEPAGE boundary,
+ *    by mapping more and unmapping the ends. Returns MAP_FAILED if it can't.
+ */
+static char *mem_map_aligned(size_t size, int flags)
+{
+    char *lo, *start;
+
+    lo = mmap(NULL, size + MEM_HUGEPAGE, PROT_READ | PROT_WRITE,
+	      MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    if (lo == MAP_FAILED)
+	return MAP_FAILED;
+    start = (char *)HUGE_ALIGN(lo);
+    if (start > lo)
+	munmap(lo, start - lo);
+    munmap(start + size, lo + MEM_HUGEPAGE - start);
+    return start;
+}
+
+/*
+ * mem_reserve - reserves size bytes of address space, aligned for huge
+ *    pages. Its pages only take memory once they are touched. Returns
+ *    NULL if the system is out of address space.
+ */
+void *mem_reserve(size_t size)
+{
+    char *lo = mem_map_aligned(size, MAP_NORESERVE);
+
+    if (lo == MAP_FAILED)
+	return NULL;
+    mem_advise(lo, size);
+    return lo;
+}
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    /* 
+     * Reserve the storage we will use to model the available VM : its
+     * pages only take memory once the heap reaches them, so MAX_HEAP
+     * can be much larger than what a trace uses
+     */
+    if ((mem_start_brk = mem_reserve(MAX_HEAP)) == NULL) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_fresh_brk = mem_start_brk;
+    mem_dirty_brk = mem_start_brk;
+    mem_peak = 0;
 }
 
 /* 
@@ -39,7 +179,7 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    munmap(mem_start_brk, MAX_HEAP);
 }
 
 /*
@@ -47,27 +187,360 @@ void mem_deinit(void)
  */
 void mem_reset_brk()
 {
+    MAP_LOCK();
     mem_brk = mem_start_brk;
+    mem_peak = mem_mapped;
+    MAP_UNLOCK();
+}
+
+/*
+ * mem_fork_prepare - takes the lock of the mappings before a fork, so that
+ *    the child doesn't get it held by a thread it doesn't have
+ */
+void mem_fork_prepare(void)
+{
+    MAP_LOCK();
+}
+
+/*
+ * mem_fork_parent - gives the lock back in the parent after a fork
+ */
+void mem_fork_parent(void)
+{
+    MAP_UNLOCK();
+}
+
+/*
+ * mem_fork_child - starts the child with the lock free
+ */
+void mem_fork_child(void)
+{
+    mem_map_lock = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap, which cannot go below its start,
+ *    and gives the pages past the new end and MEM_RELEASE_PAD back.
  */
-void *mem_sbrk(int incr) 
+void *mem_sbrk(ptrdiff_t incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if (incr < 0 && -incr > mem_brk - mem_start_brk) {
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Shrinking below the heap start...\n");
+	return (void *)-1;
+    }
+    if (incr > mem_max_addr - mem_brk) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
+    MAP_LOCK();
     mem_brk += incr;
+    if (mem_brk > mem_fresh_brk)
+	mem_fresh_brk = mem_brk;
+    if (mem_brk > mem_dirty_brk)
+	mem_dirty_brk = mem_brk;
+    mem_update_peak();
+    MAP_UNLOCK();
+    if (incr < 0) {
+	/* The heap stays reserved, its pages past the pad are released */
+	char *lo = (char *)(((uintptr_t)mem_brk + MEM_RELEASE_PAD + mem_pagesize() - 1) &
+			    ~(uintptr_t)(mem_pagesize() - 1));
+	if (lo < mem_dirty_brk) {
+	    madvise(lo, mem_dirty_brk - lo, MADV_DONTNEED);
+	    mem_dirty_brk = lo;
+	}
+    }
     return (void *)old_brk;
 }
 
+/*
+ * mem_mmap - maps size bytes of fresh memory, outside of the heap. A
+ *    region of a huge page or more is aligned for huge pages.
+ *    Returns NULL if the system is out of memory.
+ */
+void *mem_mmap(size_t size)
+{
+    mapping_t *m;
+    size_t length = size;
+    char *lo = MAP_FAILED;
+
+#if MEM_HUGEPAGES > 1 && defined(MAP_HUGETLB)
+    if (size >= MEM_HUGEPAGE) {
+	length = HUGE_ALIGN(size);
+	lo = mmap(NULL, length, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (lo == MAP_FAILED) {
+	length = size;
+	if (MEM_HUGEPAGES && size >= MEM_HUGEPAGE) {
+	    if ((lo = mem_map_aligned(size, 0)) != MAP_FAILED)
+		mem_advise(lo, size);
+	}
+	else
+	    lo = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (lo == MAP_FAILED)
+	return NULL;
+    MAP_LOCK();
+    if ((m = mem_new_node()) == NULL) {
+	MAP_UNLOCK();
+	munmap(lo, length);
+	return NULL;
+    }
+    m->lo = lo;
+    m->size = size;
+    m->length = length;
+    m->next = mem_mappings;
+    mem_mappings = m;
+    mem_mapped += size;
+    mem_update_peak();
+    MAP_UNLOCK();
+    return lo;
+}
+
+/*
+ * mem_munmap - gives back to the system a region returned by mem_mmap.
+ *    Returns -1 if ptr:size is not such a region.
+ */
+int mem_munmap(void *ptr, size_t size)
+{
+    mapping_t **mp, *m;
+
+    MAP_LOCK();
+    for (mp = &mem_mappings; *mp != NULL; mp = &(*mp)->next)
+	if ((*mp)->lo == (char *)ptr && (*mp)->size == size)
+	    break;
+    if ((m = *mp) == NULL) {
+	MAP_UNLOCK();
+	return -1;
+    }
+    *mp = m->next;
+    mem_mapped -= size;
+    size = m->length;
+    m->next = mem_free_nodes;
+    mem_free_nodes = m;
+    MAP_UNLOCK();
+    return munmap(ptr, size);
+}
+
+/*
+ * mem_mremap - resizes a region returned by mem_mmap, moving its pages
+ *    elsewhere if it can't grow in place, without copying them.
+ *    Returns NULL, and leaves the region as it was, if it can't be done,
+ *    as for explicit huge pages.
+ */
+void *mem_mremap(void *ptr, size_t old_size, size_t new_size)
+{
+#ifdef MREMAP_MAYMOVE
+    mapping_t **mp, *m;
+    char *lo;
+
+    /* The region is out of the list while it is remapped */
+    MAP_LOCK();
+    for (mp = &mem_mappings; *mp != NULL; mp = &(*mp)->next)
+	if ((*mp)->lo == (char *)ptr && (*mp)->size == old_size)
+	    break;
+    if ((m = *mp) == NULL || m->length != old_size) {
+	MAP_UNLOCK();
+	return NULL;
+    }
+    *mp = m->next;
+    MAP_UNLOCK();
+
+    lo = mremap(ptr, old_size, new_size, MREMAP_MAYMOVE);
+    MAP_LOCK();
+    if (lo != MAP_FAILED) {
+	m->lo = lo;
+	m->size = m->length = new_size;
+	mem_mapped = mem_mapped - old_size + new_size;
+	mem_update_peak();
+    }
+    m->next = mem_mappings;
+    mem_mappings = m;
+    MAP_UNLOCK();
+    return lo == MAP_FAILED ? NULL : lo;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * mem_snapshot_file - returns a new file with no name for a snapshot,
+ *    in memory if the system can
+ */
+static int mem_snapshot_file(void)
+{
+    char path[] = "/tmp/memlibXXXXXX";
+    int fd;
+
+#ifdef MFD_CLOEXEC
+    if ((fd = memfd_create("memlib", MFD_CLOEXEC)) >= 0)
+	return fd;
+#endif
+    if ((fd = mkstemp(path)) >= 0)
+	unlink(path);
+    return fd;
+}
+
+/*
+ * mem_write - writes the size bytes at p at offset off of a file
+ */
+static int mem_write(int fd, char *p, size_t size, off_t off)
+{
+    ssize_t n;
+
+    while (size > 0) {
+	if ((n = pwrite(fd, p, size, off)) < 0)
+	    return -1;
+	p += n;
+	off += n;
+	size -= n;
+    }
+    return 0;
+}
+
+/*
+ * mem_snapshot_release - frees the file and the memory of a snapshot
+ */
+static void mem_snapshot_release(struct mem_snapshot *snap)
+{
+    close(snap->fd);
+    free(snap->maps);
+    free(snap->offsets);
+    free(snap);
+}
+
+/*
+ * mem_snapshot - copies the heap and the regions of mem_mmap to a file,
+ *    for mem_restore. Returns NULL if it can't. The snapshot is kept in
+ *    memory of libc malloc, so it is for callers that don't run as it.
+ */
+struct mem_snapshot *mem_snapshot(void)
+{
+    struct mem_snapshot *snap;
+    mapping_t *m;
+    size_t page = mem_pagesize();
+    off_t off;
+    int i;
+
+    if ((snap = calloc(1, sizeof(*snap))) == NULL)
+	return NULL;
+    if ((snap->fd = mem_snapshot_file()) < 0) {
+	free(snap);
+	return NULL;
+    }
+    MAP_LOCK();
+    snap->heap_size = (size_t)(mem_brk - mem_start_brk);
+    snap->heap_length = (snap->heap_size + page - 1) & ~(page - 1);
+    snap->peak = mem_peak;
+    for (m = mem_mappings; m != NULL; m = m->next)
+	snap->num_maps++;
+    snap->maps = calloc(snap->num_maps + 1, sizeof(mapping_t));
+    snap->offsets = calloc(snap->num_maps + 1, sizeof(off_t));
+    off = snap->heap_length;
+    if (snap->maps == NULL || snap->offsets == NULL ||
+	mem_write(snap->fd, mem_start_brk, snap->heap_length, 0) < 0) {
+	MAP_UNLOCK();
+	mem_snapshot_release(snap);
+	return NULL;
+    }
+    for (i = 0, m = mem_mappings; m != NULL; m = m->next, i++) {
+	snap->maps[i] = *m;
+	snap->offsets[i] = off;
+	if (mem_write(snap->fd, m->lo, m->length, off) < 0) {
+	    MAP_UNLOCK();
+	    mem_snapshot_release(snap);
+	    return NULL;
+	}
+	off += m->length;
+    }
+    MAP_UNLOCK();
+    return snap;
+}
+
+/*
+ * mem_restore - puts the heap and the regions back as they were in a
+ *    snapshot. They are mapped copy-on-write from its file, so only the
+ *    pages written from then on are copied. Regions mapped since are
+ *    unmapped. Returns -1 if a region can't go back to its address.
+ */
+int mem_restore(struct mem_snapshot *snap)
+{
+    mapping_t *m;
+    char *lo;
+    int i;
+
+    if (snap->heap_length > 0 &&
+	mmap(mem_start_brk, snap->heap_length, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_FIXED, snap->fd, 0) == MAP_FAILED)
+	return -1;
+    MAP_LOCK();
+    while ((m = mem_mappings) != NULL) {
+	mem_mappings = m->next;
+	munmap(m->lo, m->length);
+	m->next = mem_free_nodes;
+	mem_free_nodes = m;
+    }
+    mem_mapped = 0;
+    for (i = 0; i < snap->num_maps; i++) {
+	lo = mmap(snap->maps[i].lo, snap->maps[i].length, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_FIXED_NOREPLACE, snap->fd, snap->offsets[i]);
+	if (lo != snap->maps[i].lo || (m = mem_new_node()) == NULL) {
+	    if (lo != MAP_FAILED)
+		munmap(lo, snap->maps[i].length);
+	    MAP_UNLOCK();
+	    return -1;
+	}
+	m->lo = lo;
+	m->size = snap->maps[i].size;
+	m->length = snap->maps[i].length;
+	m->next = mem_mappings;
+	mem_mappings = m;
+	mem_mapped += m->size;
+    }
+    mem_brk = mem_start_brk + snap->heap_size;
+    mem_peak = snap->peak;
+    MAP_UNLOCK();
+    return 0;
+}
+
+/*
+ * mem_snapshot_free - frees a snapshot. The heap gets fresh pages of its
+ *    own again in place of those of the snapshot, and is empty : it is to
+ *    be set up again with mm_init.
+ */
+void mem_snapshot_free(struct mem_snapshot *snap)
+{
+    if (snap->heap_length > 0 &&
+	mmap(mem_start_brk, snap->heap_length, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) != MAP_FAILED)
+	mem_advise(mem_start_brk, snap->heap_length);
+    mem_reset_brk();
+    mem_snapshot_release(snap);
+}
+
+/*
+ * mem_is_mapped - returns 1 if lo:hi lies in a region returned by mem_mmap
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+    mapping_t *m;
+    int mapped = 0;
+
+    MAP_LOCK();
+    for (m = mem_mappings; m != NULL && !mapped; m = m->next)
+	mapped = (char *)lo >= m->lo && (char *)hi < m->lo + m->size;
+    MAP_UNLOCK();
+    return mapped;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -84,6 +557,15 @@ void *mem_heap_hi()
     return (void *)(mem_brk - 1);
 }
 
+/*
+ * mem_heap_fresh - return the highest address the heap ever reached :
+ *    resets don't clear the heap, but its bytes past it are still zero
+ */
+void *mem_heap_fresh()
+{
+    return (void *)mem_fresh_brk;
+}
+
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
@@ -92,6 +574,15 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_peaksize() - returns the largest footprint, heap size plus mapped
+ *    bytes, since the heap was last reset
+ */
+size_t mem_peaksize()
+{
+    return mem_peak;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
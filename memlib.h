@@ -1,11 +1,36 @@
+#include <stddef.h>
 #include <unistd.h>
 
+/* A shrinking heap keeps the pages of its first MEM_RELEASE_PAD bytes past
+ * its end for the next growth, and gives those past them back */
+#ifndef MEM_RELEASE_PAD
+#define MEM_RELEASE_PAD ((size_t)4 << 20)
+#endif
+
 void mem_init(void);               
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_reserve(size_t size);
+void *mem_sbrk(ptrdiff_t incr);
+void *mem_mmap(size_t size);
+int mem_munmap(void *ptr, size_t size);
+void *mem_mremap(void *ptr, size_t old_size, size_t new_size);
+int mem_is_mapped(void *lo, void *hi);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
+void *mem_heap_fresh(void);
 size_t mem_heapsize(void);
+size_t mem_peaksize(void);
 size_t mem_pagesize(void);
 
+/* Fork handlers, for pthread_atfork */
+void mem_fork_prepare(void);
+void mem_fork_parent(void);
+void mem_fork_child(void);
+
+/* Snapshots of the heap and the regions of mem_mmap */
+struct mem_snapshot;
+struct mem_snapshot *mem_snapshot(void);
+int mem_restore(struct mem_snapshot *snap);
+void mem_snapshot_free(struct mem_snapshot *snap);
+
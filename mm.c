@@ -2,33 +2,63 @@
  * mm.c - Malloc implementation with external segregated lists
  * 
  * We implemented a heap memory allocator, using:
- *      - Explicit segregated free lists, with address-ordered insertion policy
- *      - We keep multiple pointers for each power of two size class
- *      - Seglist is kept on the heap 
+ *      - Explicit segregated free lists, with a compile time insertion policy
+ *        (INSERT_POLICY) : LIFO lists, or per class splay trees ordered by
+ *        address or by size. Trees reuse the two link slots of free blocks.
+ *      - We keep multiple pointers for each power of two size class, and each
+ *        power of two is split in SL_COUNT linear sub-classes (TLSF-style)
+ *      - An occupancy bitmap tells which classes are non empty, so that the
+ *        first class that fits is found with a couple of bit scans
+ *      - The seglist heads and bitmaps are kept in the arena, out of the heap :
+ *        only the slab lists sit at its start
+ *      - Built with -DMM_THREADSAFE=1 -pthread, there are MM_ARENAS independent
+ *        heaps (arenas), each behind its own lock. Threads are pinned to the
+ *        arena of their CPU and cache freed slab objects, refilled and flushed
+ *        by batches. Blocks freed by a thread of another arena are pushed on a
+ *        lock-free list that their arena drains when it next takes its lock.
+ *      - Only free blocks have a footer : the header keeps a bit telling if
+ *        the previous block is allocated, and an epilogue header at the end
+ *        of the heap tells if the last block is free
  *
  * Specifics : 
  *   Malloc :
+ *      - small requests (up to SLAB_MAX) are objects of a slab : runs of RUN_SIZE bytes
+ *        hold objects of the same class without headers, and a bitmap tracks their free slots
+ *      - runs, like other requests, are blocks of the heap :
  *      - we search for an optimal sized free block in the seglist
  *      - if its too big, we resize it
  *      - if we didn't find one, we look at the heap's last block
- *      - if its free, and big enough ("big" for us is 50*SIZE_T, but can be chosen arbitrarly), we'll only allocate the space necessary to fit the requested size
+ *      - if its free, and big enough ("big" for us is SMALL_BLOCK, 50*SIZE_T by default, but can be chosen arbitrarly), we'll only allocate the space necessary to fit the requested size
  *      - if its free and small, we'll leave it free and allocate another block. This is our policy to regroup small blocks together (even if it increases fragmentation a bit)
  *      - if its not free, and the requested size is large, allocate the needed space
- *      - if its not free and the requested block is small, allocate twice the space : Again, this enables small blocks to be near each other. 
+ *      - if its not free and the requested block is small, allocate EXPAND_FACTOR times the space (twice by default) : Again, this enables small blocks to be near each other. 
+ *      - batches of blocks of one size (mm_malloc_batch) are carved side by side out of one free block, or one heap extension
+ *      - aligned requests (mm_memalign) are split from a free block, or the top of the heap, so that the payload starts on the boundary : the leading and trailing parts go back to the seglist
  *
  *   Free : 
+ *      - Objects of a run are found with a pagemap, and given back to their run
  *      - Free the block, and coalesce with neighbors
+ *      - With DEFERRED_COALESCE, blocks up to QUICK_MAX wait instead in a quick list of their size, still marked allocated, for the next request of that size. They are coalesced all at once when a request finds no free block, or when they hold 1/QUICK_RATIO of the heap
+ *      - Batches (mm_free_batch) are sorted by address, and runs of adjacent blocks are freed as one block
+ *      - If it is then a large last block, shrink the heap (TRIM_THRESHOLD)
+ *      - Requests of MMAP_THRESHOLD bytes or more are mapped and unmapped on their own
  *
  *   Realloc : 
- *      - Try to fit the block in the neighboring free blocks. If there is enough space, we'll move the content if needed to resize the block without allocating anything new
- *      - If not, but if this block is the last, we'll add to the heap only the space needed to make this block big enough, then move data to that last block
+ *      - Growing in place comes first : into the next block if it is free and big enough, or, if this block is the last, by adding to the heap only the space needed
+ *      - If not, try to fit the block in the neighboring free blocks. If there is enough space, we'll move the content if needed to resize the block without allocating anything new
+ *      - Blocks grown once are marked (REALLOCBIT) and get headroom when they grow into a free block or move, so that the next reallocs are header updates
  *      - If the last block is full, simply add the requested size to the heap by calling mm_malloc
+ *      - Large blocks are resized by remapping their pages (mem_mremap), without copying them
  */
+#define _GNU_SOURCE     // sched_getcpu in thread-safe mode
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -54,26 +84,405 @@ team_t team = {
 #define ALIGNMENT 8
 
 /* rounds up to the nearest multiple of ALIGNMENT */
-#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(size_t)0x7)
 
+// Flags kept in the low bits of a header
+#define DIRTYBIT 1      // the block is allocated
+#define PREVDIRTYBIT 2  // the previous block in memory is allocated
+#define REALLOCBIT 4    // the block was grown by realloc, see heap_realloc
 // header is a size_t
-#define GETSIZE(header) ((header) & -2)
+#define GETSIZE(header) ((header) & ~(size_t)7)
 // header is a size_t
-#define GETDIRTYBIT(header) ((header) & 1)
-// header_ptr is a void*
+#define GETDIRTYBIT(header) ((header) & DIRTYBIT)
+#define GETPREVDIRTYBIT(header) ((header) & PREVDIRTYBIT)
+#define GETREALLOCBIT(header) ((header) & REALLOCBIT)
+// header_ptr is a void*, only free blocks have a footer
 #define GETFOOTER(header_ptr) ((header_ptr) + GETSIZE(*(size_t *)(header_ptr)) - SIZE_T_SIZE)
+// footer of the previous block, only valid if that block is free
+#define GETPREVFOOTER(header_ptr) ((header_ptr) - SIZE_T_SIZE)
 #define GETNEXTBLOCK(header_ptr) (header_ptr + GETSIZE(*(size_t *)(header_ptr)))
+// header of the epilogue block, at the end of the heap
+#define GETEPILOGUE() (arena->brk - SIZE_T_SIZE)
 // header_ptr is a void*
 #define GETNEXTFREE(header_ptr) (*(size_t *)((header_ptr) + SIZE_T_SIZE))
 #define GETPREVFREE(header_ptr) (*(size_t *)((header_ptr) + 2*SIZE_T_SIZE))
+// When a class is kept as a tree, the same two slots hold the children
+#define GETLEFT(header_ptr) (*(void **)((header_ptr) + 2*SIZE_T_SIZE))
+#define GETRIGHT(header_ptr) (*(void **)((header_ptr) + SIZE_T_SIZE))
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
+// A free block needs a header, two links and a footer
+#define MIN_BLOCK_SIZE ALIGN(4*SIZE_T_SIZE)
 
 #define DEBUG 0
 
+// Insertion policy of the seglist classes
+#define LIFO_INSERT 0       // doubly linked list, blocks are pushed in front
+#define ADDRESS_INSERT 1    // splay tree ordered by address
+#define SIZE_INSERT 2       // splay tree ordered by size, then address
+#ifndef INSERT_POLICY
+#define INSERT_POLICY SIZE_INSERT
+#endif
+
+// Number of power of two classes, the last one holds every larger block
+#ifndef MAXPOW
 #define MAXPOW 25
+#endif
+#if MAXPOW < 2 || MAXPOW > 32
+#error "the bitmap of the power of two classes is an unsigned int"
+#endif
+
+// Each power of two class is split in SL_COUNT sub-classes
+#ifndef SL_SHIFT
+#define SL_SHIFT 2
+#endif
+#if SL_SHIFT < 0 || SL_SHIFT > 5
+#error "the bitmap of the sub-classes of a power of two class is an unsigned int"
+#endif
+#define SL_COUNT (1 << SL_SHIFT)
+#define NUM_CLASSES (MAXPOW * SL_COUNT)
+// Counter of mm_stats of a class, the blocks of classes it has no room for are counted in its last
+#define STATS_CLASS(index) ((index) / SL_COUNT < MM_STATS_CLASSES ? (index) / SL_COUNT : MM_STATS_CLASSES - 1)
+// Room left at the end of blocks that keep growing with realloc
+#define REALLOC_HEADROOM(size) ALIGN((size) / 4)
+// Flag of heap_malloc_flags, beside the hints : the payload is cleared
+#define HEAP_ZERO 0x100
+
+// Fit of get_optimal_free_block
+#define FAST_FIT 0  // first block of the first class whose blocks are all large enough
+#define GOOD_FIT 1  // a few blocks of the exact class first, then as FAST_FIT
+#define BEST_FIT 2  // every block of the exact class first, then as FAST_FIT
+#ifndef FIT_POLICY
+#define FIT_POLICY GOOD_FIT
+#endif
+// Number of blocks of the exact class we look at before rounding up the request
+#if FIT_POLICY == BEST_FIT
+#define EXACT_CLASS_PROBES (1 << 30)
+#elif FIT_POLICY == GOOD_FIT
+#define EXACT_CLASS_PROBES 8
+#else
+#define EXACT_CLASS_PROBES 0
+#endif
+// Number of free blocks aligned allocations look at for an exact fit
+#define ALIGNED_PROBES 32
+// Smallest remainder split off a free block, smaller ones are left in the
+// block. Remainders below MIN_BLOCK_SIZE can't be free blocks anyway.
+#ifndef SPLIT_THRESHOLD
+#define SPLIT_THRESHOLD 0
+#endif
+#define SPLIT_SIZE (SPLIT_THRESHOLD > MIN_BLOCK_SIZE ? (size_t)SPLIT_THRESHOLD : MIN_BLOCK_SIZE)
+// Blocks of up to SMALL_BLOCK bytes are small : the heap grows by
+// EXPAND_FACTOR times their size, and the space kept after them stays free
+// for the next small blocks rather than being extended for a large one
+#ifndef SMALL_BLOCK
+#define SMALL_BLOCK (50 * SIZE_T_SIZE)
+#endif
+#ifndef EXPAND_FACTOR
+#define EXPAND_FACTOR 2
+#endif
+// Number of blocks of the heap the background sweep of mm_check_step looks at
+#define CHECK_SWEEP_BLOCKS 8
+
+// Small requests are served by a slab of page sized runs, see slab_malloc
+#ifndef SLAB
+#define SLAB 1
+#endif
+#ifndef SLAB_MAX
+#define SLAB_MAX 64                 // largest request served by the slab
+#endif
+#ifndef RUN_SIZE
+#define RUN_SIZE 2048               // runs are RUN_SIZE large and aligned
+#endif
+// 16 to 128 by steps of 16, then 160 to 256 by steps of 32
+#define SLAB_CLASSES (SLAB_MAX <= 128 ? (SLAB_MAX + 15) / 16 : 8 + (SLAB_MAX - 128 + 31) / 32)
+#define RUN_MAP_WORDS (RUN_SIZE / 16 / 32)
+#define SLAB_LIST_SIZE ALIGN(SLAB_CLASSES * sizeof(void *))
+#define PAGEMAP_MIN_PAGES 512       // first size of the pagemap, a multiple of 32
+// Until an arena has SLAB_MIN_OBJECTS small objects alive, they are heap
+// blocks : a run for a handful of objects is mostly empty, and it pins the
+// heap around it, such as a block growing at the top behind it
+#ifndef SLAB_MIN_OBJECTS
+#define SLAB_MIN_OBJECTS 16
+#endif
+// Largest heap block a small request gets
+#define SLAB_HEAP_BLOCK (ALIGN(SLAB_MAX + SIZE_T_SIZE) < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : ALIGN(SLAB_MAX + SIZE_T_SIZE))
+
+// Requests of at least MMAP_THRESHOLD bytes get a mapping of their own
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (1 << 20)
+#endif
+// Largest request of a heap block : the headers, padding and headroom
+// added to larger ones would wrap, and they can't fit in a heap anyway
+#define HEAP_MAX_REQUEST ((size_t)-1 / 4)
+// A free last block of at least TRIM_THRESHOLD bytes is given back to the
+// system, but for TRIM_PAD bytes kept for the next requests
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (1 << 17)
+#endif
+#ifndef TRIM_PAD
+#define TRIM_PAD (1 << 12)
+#endif
+// Once the heap is HEAP_CHUNK_MIN large, it grows and shrinks to HEAP_CHUNK
+// boundaries, the size of a huge page : fewer extensions, and the huge
+// pages memlib asks for are not split at the end of the heap
+#ifndef HEAP_CHUNK
+#define HEAP_CHUNK ((size_t)2 << 20)
+#endif
+#ifndef HEAP_CHUNK_MIN
+#define HEAP_CHUNK_MIN ((size_t)64 << 20)
+#endif
+
+// Coalescing of freed heap blocks
+#define IMMEDIATE_COALESCE 0    // merged with their free neighbors when they are freed
+#define DEFERRED_COALESCE 1     // small ones wait in quick lists first, see quick_push
+#ifndef COALESCE_POLICY
+#define COALESCE_POLICY IMMEDIATE_COALESCE
+#endif
+#ifndef QUICK_MAX
+#define QUICK_MAX 1024              // largest block kept in a quick list
+#endif
+#ifndef QUICK_RATIO
+#define QUICK_RATIO 16              // quick lists are emptied when they hold 1/QUICK_RATIO of the heap
+#endif
+// One quick list per block size, from MIN_BLOCK_SIZE to QUICK_MAX
+#if COALESCE_POLICY == DEFERRED_COALESCE
+#define QUICK_CLASSES ((int)((QUICK_MAX - MIN_BLOCK_SIZE) / ALIGNMENT + 1))
+#else
+#define QUICK_CLASSES 0
+#endif
+#define QUICK_LIST_SIZE ALIGN(QUICK_CLASSES * sizeof(void *))
+
+// Heap profiler, see profile_sample : compiled in unless MM_PROFILE is 0,
+// it samples nothing until mm_profile_start
+#ifndef MM_PROFILE
+#define MM_PROFILE 1
+#endif
+#define PROFILE_FRAMES 32           // frames kept of a sampled call stack
+#define PROFILE_IDLE (1 << 24)      // bytes allocated between two looks at the rate while it is off
+#define PROFILE_FILTER (1 << 16)    // counters telling a free if its block may be a sample
+
+// Everything kept at the start of the heap, before the first block
+#define PROLOGUE_SIZE (SLAB_LIST_SIZE + QUICK_LIST_SIZE)
+
+/*
+ * Header of a run, at its start. Runs with free slots are kept in a doubly
+ * linked list per class, full runs are in no list.
+ */
+typedef struct run {
+    struct run *next;
+    struct run *prev;
+    unsigned short class_index;
+    unsigned short free_count;
+    unsigned short capacity;
+    unsigned int map[RUN_MAP_WORDS];     // a bit is set if the slot is free
+} run_t;
+#define RUN_HEADER_SIZE ((sizeof(run_t) + 15) & ~(size_t)15)
+
+/*
+ * Thread-safe mode : every arena (see below) is behind its own lock, and each
+ * thread keeps a cache of freed slab objects, so that alloc/free of small
+ * objects on one thread doesn't take a lock in steady state.
+ */
+#ifndef MM_THREADSAFE
+#define MM_THREADSAFE 0
+#endif
+#define TCACHE_MAX 32       // objects kept per class in a thread cache
+#define TCACHE_BATCH 16     // objects moved at once between a thread cache and the slab
+
+// Number of independent heaps, threads are pinned to one of them
+#ifndef MM_ARENAS
+#define MM_ARENAS (MM_THREADSAFE ? 8 : 1)
+#endif
+#if MM_ARENAS > 1 && !MM_THREADSAFE
+#error "MM_ARENAS > 1 needs MM_THREADSAFE"
+#endif
+// Address space reserved by each arena but the first, which uses mem_sbrk
+#ifndef ARENA_REGION
+#if UINTPTR_MAX > 0xffffffff
+#define ARENA_REGION ((size_t)1 << 36)
+#else
+#define ARENA_REGION ((size_t)1 << 26)
+#endif
+#endif
+
+#include <sys/mman.h>
+#if MM_PROFILE
+#include <execinfo.h>
+#include <fcntl.h>
+#endif
+#if MM_THREADSAFE
+#include <pthread.h>
+#include <sched.h>
+
+// What lock-free readers (arena_of, slab_owns) look at is read and written atomically
+#define ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#define ATOMIC_ADD(ptr, val) __atomic_fetch_add((ptr), (val), __ATOMIC_RELAXED)
+#define LOCK() arena_lock()
+#define UNLOCK() pthread_mutex_unlock(&arena->lock)
+#else
+#define ATOMIC_LOAD(ptr) (*(ptr))
+#define ATOMIC_STORE(ptr, val) (*(ptr) = (val))
+#define ATOMIC_ADD(ptr, val) (*(ptr) += (val))
+#define LOCK()
+#define UNLOCK()
+#endif
+
+/*
+ * Arena : a heap with its own seglist, and its slab lists kept in its
+ * prologue, and its own memory. The first arena grows with mem_sbrk, the others in a
+ * region of ARENA_REGION bytes they map when first used.
+ */
+typedef struct arena {
+    void *lo;       // first byte of the heap
+    void *brk;      // end of the heap
+    void *max;      // end of the mapped region, NULL if the heap grows with mem_sbrk
+    // Heads of the free classes, out of the heap so that classes never used
+    // cost it nothing
+    void *free_seglist[NUM_CLASSES];
+    // Occupancy bitmaps of the classes :
+    // seglist_bitmap[0] has bit i set if power class i has a non empty sub-class,
+    // seglist_bitmap[1+i] has bit j set if sub-class j of power class i is non empty
+    unsigned int seglist_bitmap[MAXPOW + 1];
+    // Runs with free slots, one list per slab class, at the start of the heap
+    run_t **slab_runs;
+    // Blocks freed but not coalesced yet, one LIFO list per size linked through
+    // their payload, right after the slab lists in heap (DEFERRED_COALESCE)
+    void **quick_lists;
+    // One bit per RUN_SIZE page of the heap, set if the page is a run.
+    // It is itself a heap block, grown when a run lands past its end :
+    // its first word is the number of pages it covers, the bits follow.
+    size_t *slab_pagemap;
+    // Counters of this arena : the free classes, blocks_in_use, slab_objects,
+    // quick_blocks, quick_size, sbrk_calls, splits and coalesces. mm_stats
+    // derives the rest.
+    struct mm_stats stats;
+    // Incremental checker, see mm_check_step : the last block and run written
+    // by an operation, and the next block of the background sweep (NULL to
+    // start again from the first block)
+    void *touched;
+    run_t *touched_run;
+    void *sweep;
+    // Small blocks alive in the heap, counted until the first run (see
+    // SLAB_MIN_OBJECTS), and an approximation after it
+    size_t small_blocks;
+    // Highest end the heap ever had : memory past it was never handed out,
+    // and is still zero (see mm_calloc)
+    void *fresh;
+#if MM_THREADSAFE
+    // Highest end since the pages of a mapped region were last released
+    void *dirty;
+    unsigned long epoch;    // heap_epoch when the arena was set up
+    // Lock-free LIFO of blocks freed by threads of other arenas, linked
+    // through their first word. Pushed by anyone, drained by the arena.
+    void *remote_free;
+    // Last, so that the state before it can be copied without the live lock
+    pthread_mutex_t lock;
+#endif
+} arena_t;
+#define PAGEMAP_PAGES(pagemap) ((pagemap)[0])
+#define PAGEMAP_BITS(pagemap) ((unsigned int *)((pagemap) + 1))
+
+arena_t arenas[MM_ARENAS];
+int mm_threadsafe = MM_THREADSAFE;
+// Large blocks are mapped without a lock, their counters are updated atomically
+size_t large_blocks;
+size_t large_size;
+
+#if MM_THREADSAFE
+// Arena of this thread, chosen on its first call
+__thread arena_t *arena;
+// Bumped by mm_init : caches and arenas set up for a previous heap are reset
+unsigned long heap_epoch;
+pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Thread cache : one LIFO list per slab class, linked through the first
+ * word of the objects. It only holds objects of the arena of the thread.
+ * Heap blocks are not cached : their header word also holds PREVDIRTYBIT,
+ * which neighbors rewrite under the arena lock, so it can't be read or
+ * written without it.
+ */
+typedef struct {
+    unsigned long epoch;
+    int registered;
+    void *bins[SLAB_CLASSES];
+    unsigned int counts[SLAB_CLASSES];
+} tcache_t;
+__thread tcache_t tcache;
+// Gives the cache of an exiting thread back to the slab
+pthread_key_t tcache_key;
+pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+#else
+arena_t *arena = arenas;
+#endif
+
+// What mm_snapshot saves : the state of the mem_sbrk heap out of it. Only
+// the first ARENA_STATE_SIZE bytes of the arena are copied, a mutex can't be.
+#if MM_THREADSAFE
+#define ARENA_STATE_SIZE offsetof(arena_t, lock)
+#else
+#define ARENA_STATE_SIZE sizeof(arena_t)
+#endif
+typedef struct {
+    arena_t arena;
+    size_t large_blocks;
+    size_t large_size;
+#if MM_THREADSAFE
+    unsigned long heap_epoch;
+    tcache_t tcache;    // of the thread taking the snapshot
+#endif
+} mm_state_t;
+
+#if MM_THREADSAFE
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
 
-//Pointer to the seglist array in heap
-void **free_seglist;
+#if MM_PROFILE
+/*
+ * Heap profiler : every call stack that allocated a sampled block has a
+ * bucket, and every sampled block that is still allocated a sample. The
+ * tables are mapped outside the heap, and behind a spin lock of their own.
+ */
+typedef struct {
+    void *frames[PROFILE_FRAMES];
+    int depth;
+    size_t live_count, live_bytes;      // samples not freed yet
+    size_t alloc_count, alloc_bytes;    // all samples
+} bucket_t;
+typedef struct {
+    void *ptr;                  // NULL if the slot is empty
+    size_t size;
+    size_t bucket;
+} sample_t;
+static char profile_lock;
+static size_t profile_rate;             // mean bytes between two samples, 0 when off
+static size_t profile_live;             // samples not freed yet, frees only look for theirs when there are some
+static unsigned char profile_filter[PROFILE_FILTER];   // samples per hash of their address, saturated at 255
+static bucket_t *profile_buckets;
+static size_t profile_num_buckets, profile_max_buckets;
+static size_t *profile_stacks, profile_stacks_cap;     // bucket index + 1 by hash of the stack, 0 if empty
+static sample_t *profile_samples;
+static size_t profile_samples_cap;
+// Bytes left before the next sample, drawn from an exponential distribution
+static THREAD_LOCAL long profile_countdown;
+static THREAD_LOCAL size_t profile_rate_seen;
+static THREAD_LOCAL int profile_busy;   // in the profiler, or in a call that samples once on its own
+static THREAD_LOCAL unsigned long long profile_rng;
+void profile_sample(void *ptr, size_t size);
+void profile_forget(void *ptr);
+void profile_reset();
+#define PROFILE_ALLOC(ptr, size) do { \
+        if(__builtin_expect((profile_countdown -= (long)(size)) < 0, 0)) profile_sample((ptr), (size)); \
+    } while(0)
+#define PROFILE_FREE(ptr) do { \
+        if(__builtin_expect(ATOMIC_LOAD(&profile_live) != 0, 0)) profile_forget(ptr); \
+    } while(0)
+#else
+#define PROFILE_ALLOC(ptr, size)
+#define PROFILE_FREE(ptr)
+#endif
 
 /*
  * Function declaration (.h file not included in handin)
@@ -83,80 +492,553 @@ void remove_link(void *ptr);
 void add_to_list(void *ptr);
 void *get_optimal_free_block(size_t size);
 int seglist_index(size_t size);
+int seglist_search_index(size_t size);
+size_t seglist_class_size(int index);
+size_t seglist_largest(int index);
+void *seglist_first(int index);
+void *seglist_fit(int index, size_t size, int probes);
+int seglist_contains(void *ptr);
+int display_class(void *ptr);
+int check_class(void *ptr, int index, void *lo, void *hi);
 void mm_check();
+void mm_coalesce(void **header_ptr);
+void *heap_malloc(size_t size);
+void *heap_malloc_flags(size_t size, int flags);
+size_t heap_malloc_batch(size_t size, size_t n, void **out);
+void heap_free(void *ptr);
+void heap_release(void *header_ptr);
+void *heap_fit(size_t size);
+void *heap_realloc(void *ptr, size_t newsize);
+void *alloc_unlocked(size_t size);
+void *alloc_aligned(size_t size, size_t align, size_t offset);
+void *slab_malloc(size_t size);
+void slab_free(void *ptr);
+int slab_owns(arena_t *owner, void *ptr);
+int slab_class(size_t size);
+size_t slab_class_size(int class_index);
+int check_slab();
+const char *check_quick();
+void *check_step();
+void check_arena();
+int arena_setup();
+void *arena_sbrk(size_t incr);
+void *heap_grow(size_t incr);
+int arena_shrink(size_t decr);
+void heap_trim(void *header_ptr);
+void *large_malloc(size_t size);
+void large_free(void *ptr);
+void *large_realloc(void *ptr, size_t newsize);
+void *large_memalign(size_t alignment, size_t size);
+static void *realloc_block(void *ptr, size_t newsize);
+#if COALESCE_POLICY == DEFERRED_COALESCE
+int quick_push(void *header_ptr);
+void *quick_pop(size_t size);
+void quick_consolidate();
+#endif
+#if MM_THREADSAFE
+void arena_locks_init();
+void tcache_key_init();
+void arena_lock();
+void remote_free(arena_t *owner, void *ptr);
+void *tcache_malloc(int class_index);
+void tcache_free(void *ptr, int class_index);
+#endif
 
 /* 
  * mm_init - initialize the malloc package.
+ *     In thread-safe mode, the calling thread uses the first arena, and
+ *     the others are set up again when their threads next use them.
  */
 int mm_init()
 {
 #if DEBUG    
     printf("\n\n\n##########INIT###########\n\n\n");
 #endif
+#if MM_THREADSAFE
+    pthread_once(&arena_once, arena_locks_init);
+    // Objects left in thread caches belong to the previous heap
+    ATOMIC_STORE(&heap_epoch, heap_epoch + 1);
+#endif
+    arena = arenas;
+#if MM_PROFILE
+    // Samples of the previous heap are no longer allocated
+    if(ATOMIC_LOAD(&profile_live) != 0) profile_reset();
+#endif
+    return arena_setup();
+}
+
+/*
+ * arena_setup - sets up an empty heap in the arena of this thread
+ */
+int arena_setup()
+{
     int i = 0;
-    mem_sbrk(ALIGN(MAXPOW * sizeof(void *)));
-    free_seglist = mem_heap_lo();
-    if (free_seglist == NULL) return 0;
-    for (i = 0; i < MAXPOW; i++){
-        free_seglist[i] = NULL;
+    if(arena == arenas){
+        arena->lo = mem_heap_hi() + 1;
+        arena->fresh = mem_heap_fresh();
+    }
+#if MM_THREADSAFE
+    else if(arena->max == NULL){
+        void *region = mem_reserve(ARENA_REGION);
+        if(region == NULL) return -1;
+        arena->max = region + ARENA_REGION;
+        arena->fresh = region;
+        arena->dirty = region;
+        ATOMIC_STORE(&arena->lo, region);
+    }
+    arena->remote_free = NULL;
+    arena->epoch = heap_epoch;
+#endif
+    ATOMIC_STORE(&arena->brk, arena->lo);
+    memset(&arena->stats, 0, sizeof(arena->stats));
+    arena->touched = NULL;
+    arena->touched_run = NULL;
+    arena->sweep = NULL;
+    arena->small_blocks = 0;
+    for (i = 0; i < NUM_CLASSES; i++){
+        arena->free_seglist[i] = NULL;
+    }
+    for (i = 0; i < MAXPOW + 1; i++){
+        arena->seglist_bitmap[i] = 0;
+    }
+    // The slab lists are followed by the epilogue, an empty allocated block
+    // whose PREVDIRTYBIT tells if the last block of the heap is free
+    if (arena_sbrk(PROLOGUE_SIZE + SIZE_T_SIZE) == (void *)-1) return -1;
+    *(size_t *)GETEPILOGUE() = PREVDIRTYBIT | DIRTYBIT;
+    arena->slab_runs = (run_t **)arena->lo;
+    for (i = 0; i < SLAB_CLASSES; i++){
+        arena->slab_runs[i] = NULL;
+    }
+    arena->quick_lists = (void **)((void *)arena->slab_runs + SLAB_LIST_SIZE);
+    for (i = 0; i < QUICK_CLASSES; i++){
+        arena->quick_lists[i] = NULL;
+    }
+    ATOMIC_STORE(&arena->slab_pagemap, NULL);
+    return 1;
+}
+
+/*
+ * arena_sbrk - extends the heap of the arena by incr bytes, and returns
+ *     the start of the new area
+ */
+void *arena_sbrk(size_t incr)
+{
+    void *old_brk = arena->brk;
+    if(arena->max == NULL){
+        if(mem_sbrk((ptrdiff_t)incr) == (void *)-1) return (void *)-1;
+    }
+    else if(incr > (size_t)(arena->max - old_brk)) return (void *)-1;
+    arena->stats.sbrk_calls++;
+    ATOMIC_STORE(&arena->brk, old_brk + incr);
+    if(arena->brk > arena->fresh) arena->fresh = arena->brk;
+#if MM_THREADSAFE
+    if(arena->brk > arena->dirty) arena->dirty = arena->brk;
+#endif
+    return old_brk;
+}
+
+/*
+ * heap_chunk_end - where the heap should end to reach end : end itself,
+ *     or the next HEAP_CHUNK boundary once the heap is large
+ */
+static inline void *heap_chunk_end(void *end)
+{
+    if((size_t)(end - arena->lo) < HEAP_CHUNK_MIN) return end;
+    return (void *)(((uintptr_t)end + HEAP_CHUNK - 1) & ~(uintptr_t)(HEAP_CHUNK - 1));
+}
+
+/*
+ * heap_grow - extends the heap by at least incr bytes for a block, up to
+ *     heap_chunk_end, and returns the start of the new area
+ */
+void *heap_grow(size_t incr)
+{
+    return arena_sbrk((size_t)(heap_chunk_end(arena->brk + incr) - arena->brk));
+}
+
+/*
+ * arena_shrink - gives back to the system the last decr bytes of the heap
+ *     of the arena, returns 0 if it can't
+ */
+int arena_shrink(size_t decr)
+{
+    void *new_brk = arena->brk - decr;
+    if(arena->max == NULL){
+        if(mem_sbrk(-(ptrdiff_t)decr) == (void *)-1) return 0;
+    }
+#if MM_THREADSAFE
+    else {
+        // The region stays reserved, only its pages past the pad are released
+        uintptr_t page = mem_pagesize();
+        uintptr_t lo = ((uintptr_t)new_brk + MEM_RELEASE_PAD + page - 1) & ~(page - 1);
+        if(lo < (uintptr_t)arena->dirty){
+            madvise((void *)lo, (uintptr_t)arena->dirty - lo, MADV_DONTNEED);
+            arena->dirty = (void *)lo;
+        }
     }
+#endif
+    arena->stats.sbrk_calls++;
+    if(arena->sweep >= new_brk - SIZE_T_SIZE) arena->sweep = NULL;
+    ATOMIC_STORE(&arena->brk, new_brk);
     return 1;
 }
 
+/*
+ * arena_of - returns the arena holding ptr, NULL if there is none (large
+ *     blocks have their own mapping). The bounds of an arena only grow, or
+ *     shrink over free memory, so this needs no lock.
+ */
+static inline arena_t *arena_of(void *ptr)
+{
+    int i;
+    for(i = 0; i < MM_ARENAS; i++){
+        if(ptr >= ATOMIC_LOAD(&arenas[i].lo) && ptr < ATOMIC_LOAD(&arenas[i].brk))
+            return &arenas[i];
+    }
+    return NULL;
+}
+
+/*
+ * slab_run - returns the run holding a slab object
+ */
+static inline run_t *slab_run(void *ptr){
+    return (run_t *)(((uintptr_t)ptr & ~(uintptr_t)(RUN_SIZE - 1)) + SIZE_T_SIZE);
+}
+
+#if MM_THREADSAFE
+void arena_locks_init(){
+    int i;
+    for(i = 0; i < MM_ARENAS; i++) pthread_mutex_init(&arenas[i].lock, NULL);
+}
+
+/*
+ * arena_lock - takes the lock of the arena of this thread, and gives back
+ *     to it the blocks other threads freed
+ */
+void arena_lock(){
+    pthread_mutex_lock(&arena->lock);
+    if(ATOMIC_LOAD(&arena->remote_free) == NULL) return;
+    void *ptr = __atomic_exchange_n(&arena->remote_free, NULL, __ATOMIC_ACQUIRE);
+    while(ptr != NULL){
+        void *next = *(void **)ptr;
+#if SLAB
+        if(slab_owns(arena, ptr)) slab_free(ptr);
+        else
+#endif
+        heap_free(ptr);
+        ptr = next;
+    }
+}
+
+/*
+ * remote_free - frees a block of another arena without taking its lock :
+ *     it is pushed on the remote list of the arena, which takes it back
+ *     the next time one of its threads takes the lock
+ */
+void remote_free(arena_t *owner, void *ptr){
+    void *head = ATOMIC_LOAD(&owner->remote_free);
+    do {
+        *(void **)ptr = head;
+    } while(!__atomic_compare_exchange_n(&owner->remote_free, &head, ptr, 1,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * thread_enter - returns the cache of this thread, emptied if it was filled
+ *     from a previous heap. On the first call of a thread, pins it to the
+ *     arena of the CPU it runs on.
+ */
+static inline tcache_t *thread_enter(){
+    tcache_t *cache = &tcache;
+    unsigned long epoch = ATOMIC_LOAD(&heap_epoch);
+    if(cache->epoch != epoch){
+        memset(cache->bins, 0, sizeof(cache->bins));
+        memset(cache->counts, 0, sizeof(cache->counts));
+        cache->epoch = epoch;
+        if(arena == NULL){
+            // The mem_sbrk heap is left to the thread of mm_init when
+            // there are mapped arenas
+            int cpu = sched_getcpu();
+            if(cpu < 0) cpu = (int)((uintptr_t)pthread_self() >> 12);
+            if(MM_ARENAS > 1) arena = &arenas[1 + cpu % (MM_ARENAS - 1)];
+            else arena = arenas;
+        }
+        // Arenas are set up again by their first thread after mm_init
+        pthread_mutex_lock(&arena->lock);
+        if(arena->epoch != epoch && arena_setup() < 0){
+            pthread_mutex_unlock(&arena->lock);
+            arena = arenas;
+        }
+        else pthread_mutex_unlock(&arena->lock);
+    }
+    if(!cache->registered){
+        pthread_once(&tcache_once, tcache_key_init);
+        pthread_setspecific(tcache_key, cache);
+        cache->registered = 1;
+    }
+    return cache;
+}
+#endif
+
+/*
+ * display_class - display the blocks of a class in order, returns their number
+ */
+int display_class(void *ptr){
+    int i = 0;
+#if INSERT_POLICY == LIFO_INSERT
+    while(ptr != NULL){
+        i++;
+        printf("Addr : %p\t", ptr);
+        ptr = (void *)GETNEXTFREE(ptr);
+    }
+#else
+    if(ptr == NULL) return 0;
+    i += display_class(GETLEFT(ptr));
+    printf("Addr : %p\t", ptr);
+    i += 1 + display_class(GETRIGHT(ptr));
+#endif
+    return i;
+}
+
 /*
  * display_free - display the contents of the seglist
  */
 void display_free(){
     int index = 0;
-    while(index < MAXPOW){
-        printf("SIZE : %d :: ", 1<<(index+5));
-        void *ptr = free_seglist[index];
-        int i = 0;
-        while(ptr != NULL){
-            i++;
-            printf("Addr : %x\t", ptr);
-            ptr = (void *)GETNEXTFREE(ptr);
-        }
-        printf("%d\n", i);
+    while(index < NUM_CLASSES){
+        if(arena->free_seglist[index] == NULL){
+            index++;
+            continue;
+        }
+        printf("SIZE : %lu :: ", (unsigned long)seglist_class_size(index));
+        printf("%d\n", display_class(arena->free_seglist[index]));
         index++;
     }
 }
 
+/*
+ * mm_malloc - Allocate a block, from the slab if it is small
+ */
+void *mm_malloc(size_t size)
+{
+    void *p;
+    if(size == 0) return NULL;
+#if MM_THREADSAFE
+    thread_enter();
+#if SLAB
+    if(size <= SLAB_MAX){
+        p = tcache_malloc(slab_class(size));
+        PROFILE_ALLOC(p, size);
+        return p;
+    }
+#endif
+#endif
+    if(size >= MMAP_THRESHOLD) p = large_malloc(size);
+    else {
+        LOCK();
+        p = alloc_unlocked(size);
+        UNLOCK();
+    }
+    PROFILE_ALLOC(p, size);
+    return p;
+}
+
+/*
+ * mm_calloc - Allocate a block of nmemb * size bytes set to zero, NULL if
+ *     the product overflows. Fresh memory is zero already : a new mapping,
+ *     or the part of the block the heap never handed out before, which
+ *     heap_malloc_flags leaves alone.
+ */
+void *mm_calloc(size_t nmemb, size_t size)
+{
+    size_t bytes;
+    void *p;
+    if(__builtin_mul_overflow(nmemb, size, &bytes) || bytes == 0) return NULL;
+    // A product that doesn't overflow can still be too large to allocate
+    if(bytes > HEAP_MAX_REQUEST) return NULL;
+    if(bytes >= MMAP_THRESHOLD || (bytes <= SLAB_MAX && SLAB)){
+        // Slab objects are small enough to be cleared anyway
+        p = mm_malloc(bytes);
+        if(p != NULL && bytes < MMAP_THRESHOLD) memset(p, 0, bytes);
+        return p;
+    }
+#if MM_THREADSAFE
+    thread_enter();
+#endif
+    LOCK();
+    p = heap_malloc_flags(bytes, HEAP_ZERO);
+    UNLOCK();
+    PROFILE_ALLOC(p, bytes);
+    return p;
+}
+
+/*
+ * mm_malloc_batch - Allocate n blocks of size bytes, stored in out. Heap
+ *     blocks are carved out of a single free region, slab objects are
+ *     taken under a single lock. Returns the number of blocks allocated,
+ *     less than n if we ran out of memory.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
+{
+    size_t i = 0;
+    if(size == 0 || n == 0) return 0;
+#if MM_THREADSAFE
+    thread_enter();
+#endif
+    if(size >= MMAP_THRESHOLD){
+        while(i < n && (out[i] = large_malloc(size)) != NULL) i++;
+    }
+    else {
+        LOCK();
+#if SLAB
+        if(size <= SLAB_MAX){
+            while(i < n && (out[i] = slab_malloc(size)) != NULL) i++;
+        }
+        else
+#endif
+        i = heap_malloc_batch(size, n, out);
+        UNLOCK();
+    }
+#if MM_PROFILE
+    size_t j;
+    for(j = 0; j < i; j++) PROFILE_ALLOC(out[j], size);
+#endif
+    return i;
+}
+
+/*
+ * alloc_unlocked - Allocate from the slab or the heap, the caller holds the lock
+ */
+void *alloc_unlocked(size_t size)
+{
+#if SLAB
+    if(size <= SLAB_MAX) return slab_malloc(size);
+#endif
+    return heap_malloc(size);
+}
+
+/*
+ * mm_malloc_hinted - Allocate a block, placed after what flags
+ *     (MM_HINT_*) tell of its life. Blocks that will grow are heap blocks
+ *     with headroom, even when they are small.
+ */
+void *mm_malloc_hinted(size_t size, int flags)
+{
+    if(size == 0) return NULL;
+    if(size >= MMAP_THRESHOLD || (size <= SLAB_MAX && SLAB && !(flags & MM_HINT_REALLOC)))
+        return mm_malloc(size);
+#if MM_THREADSAFE
+    thread_enter();
+#endif
+    LOCK();
+    void *p = heap_malloc_flags(size, flags);
+    UNLOCK();
+    PROFILE_ALLOC(p, size);
+    return p;
+}
+
+/*
+ * mm_memalign - Allocate a block whose payload starts on an alignment
+ *     boundary (a power of two). The block is split from a free block, or
+ *     from the top of the heap, and the remainders on both sides are free.
+ */
+void *mm_memalign(size_t alignment, size_t size)
+{
+    if(size == 0 || alignment == 0 || (alignment & (alignment - 1))) return NULL;
+    if(alignment <= ALIGNMENT) return mm_malloc(size);
+    void *p;
+    if(size >= MMAP_THRESHOLD && alignment <= mem_pagesize()) p = large_memalign(alignment, size);
+    else {
+#if MM_THREADSAFE
+        thread_enter();
+#endif
+        LOCK();
+        p = alloc_aligned(size, alignment, 0);
+        UNLOCK();
+    }
+    PROFILE_ALLOC(p, size);
+    return p;
+}
+
+/*
+ * heap_malloc - Allocate a block of the heap, with the default placement
+ */
+void *heap_malloc(size_t size)
+{
+    return heap_malloc_flags(size, 0);
+}
+
+/*
+ * heap_zero - clears the size bytes of a payload, but for those past
+ *     fresh, which are zero already
+ */
+static inline void heap_zero(void *payload, size_t size, void *fresh)
+{
+    if(payload >= fresh) return;
+    if((size_t)(fresh - payload) < size) size = (size_t)(fresh - payload);
+    memset(payload, 0, size);
+}
+
 /* 
- * mm_malloc - Allocate a block by incrementing the brk pointer.
+ * heap_malloc_flags - Allocate a block by incrementing the brk pointer.
  *     Always allocate a block whose size is a multiple of the alignment.
+ *     flags are hints of mm_malloc_hinted, and HEAP_ZERO to clear the
+ *     payload.
  */
-void *mm_malloc(size_t size)
+void *heap_malloc_flags(size_t size, int flags)
 {
     
 #if DEBUG
-    printf("Asking Malloc for size %d\n", size);
+    printf("Asking Malloc for size %zu\n", size);
     display_free();
 #endif 
 
-    if(size == 0) return NULL;
+    if(size == 0 || size > HEAP_MAX_REQUEST) return NULL;
     
-    size_t new_size = ALIGN(size + 2*SIZE_T_SIZE);
-    if(new_size < ALIGN(4*SIZE_T_SIZE)) new_size = ALIGN(4*SIZE_T_SIZE);
-    size_t new_header = new_size | 1; // set dirty bit to 1
-    void *p = get_optimal_free_block(new_size);
-    void *end = mem_heap_hi();
+    // Allocated blocks only have a header
+    size_t new_size = ALIGN(size + SIZE_T_SIZE);
+    if(new_size < MIN_BLOCK_SIZE) new_size = MIN_BLOCK_SIZE;
+    if(flags & MM_HINT_REALLOC) new_size += REALLOC_HEADROOM(new_size);
+    // When the heap grows, small blocks get room for a neighbor so that
+    // they stay next to each other. Hints tell which blocks should.
+#if EXPAND_FACTOR > 1
+    int reserve = new_size <= SMALL_BLOCK;
+    if(flags & MM_HINT_SHORT_LIVED) reserve = new_size < TRIM_THRESHOLD;
+    if(flags & (MM_HINT_LONG_LIVED | MM_HINT_REALLOC)) reserve = 0;
+#endif
+    void *p;
+    void *fresh = arena->fresh;
+#if COALESCE_POLICY == DEFERRED_COALESCE
+    //A block of this size freed lately is used as it is
+    if((p = quick_pop(new_size)) != NULL){
+        if(flags & MM_HINT_REALLOC) *(size_t *)p |= REALLOCBIT;
+        if(flags & HEAP_ZERO) heap_zero(p + SIZE_T_SIZE, size, fresh);
+        arena->stats.blocks_in_use++;
+        arena->touched = p;
+        return p + SIZE_T_SIZE;
+    }
+#endif
+    p = heap_fit(new_size);
+    void *end = GETEPILOGUE();
     if(p != NULL)
     {
 #if DEBUG
-        printf("Found a spot %x in memory\n", p);
+        printf("Found a spot %p in memory\n", p);
 #endif
         remove_link(p);    
-        int old_size = GETSIZE(*(size_t *)p);
-        if(old_size - new_size >= ALIGN(4*SIZE_T_SIZE)){
+        size_t old_size = GETSIZE(*(size_t *)p);
+        if(old_size - new_size >= SPLIT_SIZE){
             void *leftover = p + new_size;
-            *(size_t *)leftover = old_size - new_size;
-            *(size_t *)GETFOOTER(leftover) = old_size - new_size;
+            *(size_t *)leftover = (old_size - new_size) | PREVDIRTYBIT;
+            *(size_t *)GETFOOTER(leftover) = *(size_t *)leftover;
             add_to_list(leftover);
+            arena->stats.splits++;
+        }
+        else {
+            new_size = old_size;
+            *(size_t *)(p + new_size) |= PREVDIRTYBIT;
         }
-        else new_header = old_size | 1;
-        *(size_t *)p = new_header;
-        *(size_t *)GETFOOTER(p) = new_header;
+        *(size_t *)p = new_size | GETPREVDIRTYBIT(*(size_t *)p) | DIRTYBIT;
     }
     else
     {
@@ -164,20 +1046,20 @@ void *mm_malloc(size_t size)
         printf("allocating space\n");
 #endif
 
-        // end is now the footer of the last block of the heap
-        end -= SIZE_T_SIZE - 1;
-
-        if (mem_heapsize() != 0 && !GETDIRTYBIT(*(size_t *)end)) {
+        // New space starts on the epilogue, which is moved to the new end
+        if (!GETPREVDIRTYBIT(*(size_t *)end)) {
             // The last block of the heap is free.
             // We will look at its size, and if it's big enough
             // we will expand to fit the size asked by the user
+            size_t last_size = GETSIZE(*(size_t *)GETPREVFOOTER(end));
 
-            if (GETSIZE(*(size_t *) end) > 50 * SIZE_T_SIZE) {
+            if (last_size > SMALL_BLOCK && last_size < new_size) {
                 // The block is big enough not to ignore it,
                 // otherwise we would have a big fragmentation.
                 // We expand it to the size required by the user.
-                p = end - GETSIZE(*(size_t *) end) + SIZE_T_SIZE;
-                mem_sbrk((int) GETSIZE(new_header) - GETSIZE(*(size_t *) end));
+                p = end - last_size;
+                if (heap_grow(new_size - last_size) == (void *)-1)
+                    return NULL;
                 remove_link(p);
             } else {
                 // The last block is rather small, we let it
@@ -187,9 +1069,9 @@ void *mm_malloc(size_t size)
                 // This allows us to manage the place of blocks
                 // in the heap, depending of their sizes: small
                 // blocks are next one to another.
-                p = mem_sbrk((int) GETSIZE(new_header));
-                if (p == NULL)
+                if (heap_grow(new_size) == (void *)-1)
                     return NULL;
+                p = end;
             }
 
         } else {
@@ -206,391 +1088,2160 @@ void *mm_malloc(size_t size)
             // This allows us to manage the place of blocks
             // in the heap, depending of their sizes: small
             // blocks are next one to another.
-            if (GETSIZE(new_header) > 50 * SIZE_T_SIZE) {
-                p = mem_sbrk((int) GETSIZE(new_header));
-                if (p == NULL)
-                    return NULL;
-            } else {
-                p = mem_sbrk((int) GETSIZE(new_header) * 2);
-                if (p == NULL)
-                    return NULL;
-                *(size_t *) (p + GETSIZE(new_header)) = new_header & -2;
-                *(size_t *) (GETFOOTER(p + GETSIZE(new_header))) = new_header & -2;
-                add_to_list(p + GETSIZE(new_header));
-            }
+            p = end;
+            size_t room = 0;
+#if EXPAND_FACTOR > 1
+            if (reserve) room = (EXPAND_FACTOR - 1) * new_size;
+#endif
+            if (heap_grow(new_size + room) == (void *)-1)
+                return NULL;
         }
-        *(size_t *)p = new_header;
-        *(size_t *)(GETFOOTER(p)) = new_header;
+        // What the extension gave past the block stays free at the end
+        size_t rest = (size_t)(GETEPILOGUE() - p) - new_size;
+        if (rest >= MIN_BLOCK_SIZE) {
+            *(size_t *) (p + new_size) = rest | PREVDIRTYBIT;
+            *(size_t *) (GETFOOTER(p + new_size)) = rest | PREVDIRTYBIT;
+            add_to_list(p + new_size);
+        } else new_size += rest;
+        *(size_t *)p = new_size | GETPREVDIRTYBIT(*(size_t *)p) | DIRTYBIT;
+        *(size_t *)GETEPILOGUE() = DIRTYBIT | (GETEPILOGUE() == p + new_size ? PREVDIRTYBIT : 0);
     }
 #if DEBUG
-    printf("Giving out at address %x\n", p+SIZE_T_SIZE);
+    printf("Giving out at address %p\n", p+SIZE_T_SIZE);
 //    display_free();
 #endif
+    if(flags & MM_HINT_REALLOC) *(size_t *)p |= REALLOCBIT;
+    if(flags & HEAP_ZERO) heap_zero(p + SIZE_T_SIZE, size, fresh);
+    arena->stats.blocks_in_use++;
+    arena->touched = p;
     return p + SIZE_T_SIZE;
 }
 
 /*
- * remove_link - removes a link from the right seg free list
+ * heap_malloc_batch - Allocate n blocks of size bytes. Free blocks too small
+ *     for the rest of the batch are used one by one, then the blocks left
+ *     are carved next to each other out of a free block big enough for all
+ *     of them, or out of the top of the heap in a single extension.
  */
-void remove_link(void *ptr){
-#if DEBUG
-    printf("Removing %x\n", ptr);
+size_t heap_malloc_batch(size_t size, size_t n, void **out)
+{
+    size_t i = 0;
+    if(size > HEAP_MAX_REQUEST) return 0;
+    size_t new_size = ALIGN(size + SIZE_T_SIZE);
+    if(new_size < MIN_BLOCK_SIZE) new_size = MIN_BLOCK_SIZE;
+    if(n > ((size_t)-1) / new_size) return 0;
+#if COALESCE_POLICY == DEFERRED_COALESCE
+    //Blocks of this size freed lately first
+    void *q;
+    while(i < n && (q = quick_pop(new_size)) != NULL){
+        arena->stats.blocks_in_use++;
+        arena->touched = q;
+        out[i++] = q + SIZE_T_SIZE;
+    }
+    if(i == n) return n;
 #endif
-    if((void *)GETNEXTFREE(ptr) == NULL && (void *)GETPREVFREE(ptr) == NULL) {
-        free_seglist[seglist_index(GETSIZE(*(size_t *) ptr))] = NULL;
+    void *p = heap_fit(new_size * (n - i));
+    while(p == NULL && i < n && get_optimal_free_block(new_size) != NULL){
+        if((out[i] = heap_malloc(size)) == NULL) return i;
+        i++;
+        if(i < n) p = heap_fit(new_size * (n - i));
     }
-    else if((void *)GETNEXTFREE(ptr) == NULL) {
-        GETNEXTFREE((void *) GETPREVFREE(ptr)) = (size_t) NULL;
+    if(i == n) return n;
+    out += i;
+    n -= i;
+
+    size_t total = new_size * n;
+    size_t region = 0;
+    if(p != NULL){
+        remove_link(p);
+        region = GETSIZE(*(size_t *)p);
+    }
+    else {
+        //Use the top of the heap, with the last block if it is free
+        void *end = GETEPILOGUE();
+        p = end;
+        if(!GETPREVDIRTYBIT(*(size_t *)end)){
+            region = GETSIZE(*(size_t *)GETPREVFOOTER(end));
+            p = end - region;
+            remove_link(p);
+        }
+        if(region < total){
+            if(heap_grow(total - region) == (void *)-1){
+                if(region > 0) add_to_list(p);
+                //One by one, with what is left
+                size_t j;
+                for(j = 0; j < n && (out[j] = heap_malloc(size)) != NULL; j++);
+                return i + j;
+            }
+            //What the extension gave past the batch is split off below
+            region = GETEPILOGUE() - p;
+            *(size_t *)GETEPILOGUE() = DIRTYBIT;
+        }
+    }
+
+    //Carve the blocks, the last one keeps a remainder too small to be free
+    size_t prev_dirty = GETPREVDIRTYBIT(*(size_t *)p);
+    size_t j;
+    for(j = 0; j < n; j++){
+        void *block = p + j * new_size;
+        *(size_t *)block = new_size | (j == 0 ? prev_dirty : PREVDIRTYBIT) | DIRTYBIT;
+        out[j] = block + SIZE_T_SIZE;
+    }
+    if(region - total >= SPLIT_SIZE){
+        void *rest = p + total;
+        *(size_t *)rest = (region - total) | PREVDIRTYBIT;
+        *(size_t *)GETFOOTER(rest) = *(size_t *)rest;
+        add_to_list(rest);
+        arena->stats.splits++;
+        *(size_t *)(p + region) &= ~(size_t)PREVDIRTYBIT;
+    }
+    else {
+        *(size_t *)(p + total - new_size) += region - total;
+        *(size_t *)(p + region) |= PREVDIRTYBIT;
+    }
+    arena->stats.blocks_in_use += n;
+    arena->touched = p;
+    return i + n;
+}
+
+#if INSERT_POLICY != LIFO_INSERT
+/*
+ * block_cmp - order of free blocks in a seglist tree
+ *     Blocks are ordered by address, or by size then address, so that keys
+ *     are always unique.
+ */
+static inline int block_cmp(void *a, void *b){
+#if INSERT_POLICY == SIZE_INSERT
+    size_t size_a = GETSIZE(*(size_t *)a);
+    size_t size_b = GETSIZE(*(size_t *)b);
+    if(size_a != size_b) return size_a < size_b ? -1 : 1;
+#endif
+    if(a == b) return 0;
+    return a < b ? -1 : 1;
+}
+
+/*
+ * tree_splay - top-down splay of the tree rooted at root around key
+ *     No parent pointer is needed, so the two link slots of a free block
+ *     are enough to hold a tree node.
+ */
+static void *tree_splay(void *root, void *key){
+    // Fake node holding the roots of the left and right trees built on the way down
+    void *frame[3 * SIZE_T_SIZE / sizeof(void *)];
+    void *fake = (void *)frame;
+    void *left = fake, *right = fake, *t = root, *y;
+    GETLEFT(fake) = NULL;
+    GETRIGHT(fake) = NULL;
+    for(;;){
+        int c = block_cmp(key, t);
+        if(c < 0){
+            if(GETLEFT(t) == NULL) break;
+            if(block_cmp(key, GETLEFT(t)) < 0){
+                //Rotate right
+                y = GETLEFT(t);
+                GETLEFT(t) = GETRIGHT(y);
+                GETRIGHT(y) = t;
+                t = y;
+                if(GETLEFT(t) == NULL) break;
+            }
+            //Link right
+            GETLEFT(right) = t;
+            right = t;
+            t = GETLEFT(t);
+        }
+        else if(c > 0){
+            if(GETRIGHT(t) == NULL) break;
+            if(block_cmp(key, GETRIGHT(t)) > 0){
+                //Rotate left
+                y = GETRIGHT(t);
+                GETRIGHT(t) = GETLEFT(y);
+                GETLEFT(y) = t;
+                t = y;
+                if(GETRIGHT(t) == NULL) break;
+            }
+            //Link left
+            GETRIGHT(left) = t;
+            left = t;
+            t = GETRIGHT(t);
+        }
+        else break;
+    }
+    //Assemble
+    GETRIGHT(left) = GETLEFT(t);
+    GETLEFT(right) = GETRIGHT(t);
+    GETLEFT(t) = GETRIGHT(fake);
+    GETRIGHT(t) = GETLEFT(fake);
+    return t;
+}
+
+/*
+ * tree_first - returns the leftmost block of a tree
+ */
+static void *tree_first(void *node){
+    while(GETLEFT(node) != NULL) node = GETLEFT(node);
+    return node;
+}
+
+#if INSERT_POLICY == ADDRESS_INSERT
+/*
+ * tree_probe - looks at the low address blocks of a tree for a block of at
+ *     least size bytes, visiting at most *probes nodes
+ */
+static void *tree_probe(void *node, size_t size, int *probes){
+    void *found;
+    if(node == NULL || *probes <= 0) return NULL;
+    (*probes)--;
+    if((found = tree_probe(GETLEFT(node), size, probes)) != NULL) return found;
+    if(GETSIZE(*(size_t *)node) >= size) return node;
+    return tree_probe(GETRIGHT(node), size, probes);
+}
+#endif
+#endif
+
+/*
+ * remove_link - removes a link from the right seg free list
+ */
+void remove_link(void *ptr){
+#if DEBUG
+    printf("Removing %p\n", ptr);
+#endif
+    size_t size = GETSIZE(*(size_t *) ptr);
+    int index = seglist_index(size);
+    arena->stats.class_free[STATS_CLASS(index)] -= size;
+    arena->stats.class_blocks[STATS_CLASS(index)]--;
+#if INSERT_POLICY == LIFO_INSERT
+    if((void *)GETNEXTFREE(ptr) == NULL && (void *)GETPREVFREE(ptr) == NULL) {
+        arena->free_seglist[index] = NULL;
+    }
+    else if((void *)GETNEXTFREE(ptr) == NULL) {
+        GETNEXTFREE((void *) GETPREVFREE(ptr)) = (size_t) NULL;
+    }
+    else if((void *)GETPREVFREE(ptr) == NULL){
+        GETPREVFREE((void *)GETNEXTFREE(ptr)) = (size_t) NULL;
+        arena->free_seglist[index] = (void *)GETNEXTFREE(ptr);
+    }
+    else{
+        GETNEXTFREE((void *)GETPREVFREE(ptr)) = GETNEXTFREE(ptr);
+        GETPREVFREE((void *)GETNEXTFREE(ptr)) = GETPREVFREE(ptr);
+    }
+#else
+    //Bring the block to the root, then join its two subtrees
+    void *root = tree_splay(arena->free_seglist[index], ptr);
+    if(GETLEFT(root) == NULL) arena->free_seglist[index] = GETRIGHT(root);
+    else {
+        //Everything on the left is smaller than ptr: splaying brings the max up, with no right child
+        void *left = tree_splay(GETLEFT(root), ptr);
+        GETRIGHT(left) = GETRIGHT(root);
+        arena->free_seglist[index] = left;
+    }
+#endif
+    if(arena->free_seglist[index] == NULL){
+        //The class is now empty, update the bitmaps
+        arena->seglist_bitmap[1 + index / SL_COUNT] &= ~(1U << (index % SL_COUNT));
+        if(arena->seglist_bitmap[1 + index / SL_COUNT] == 0)
+            arena->seglist_bitmap[0] &= ~(1U << (index / SL_COUNT));
+    }
+#if DEBUG
+    display_free();
+#endif
+}
+
+/*
+ * add_to_list - adds a link to the right seglist
+ */
+void add_to_list(void *ptr){
+#if DEBUG
+    printf("Adding %p, size of block is %zu\n", ptr, GETSIZE(*(size_t*)ptr));
+#endif
+    size_t size = GETSIZE(*(size_t *)ptr);
+    int index = seglist_index(size);
+    void *root = arena->free_seglist[index];
+    arena->stats.class_free[STATS_CLASS(index)] += size;
+    arena->stats.class_blocks[STATS_CLASS(index)]++;
+    if(root == NULL){
+        GETNEXTFREE(ptr) = (size_t)NULL;
+        GETPREVFREE(ptr) = (size_t)NULL;
+        arena->seglist_bitmap[0] |= 1U << (index / SL_COUNT);
+        arena->seglist_bitmap[1 + index / SL_COUNT] |= 1U << (index % SL_COUNT);
+    }
+    else {
+#if INSERT_POLICY == LIFO_INSERT
+        //Push in front of the list
+        GETNEXTFREE(ptr) = (size_t)root;
+        GETPREVFREE(ptr) = (size_t)NULL;
+        GETPREVFREE(root) = (size_t)ptr;
+#else
+        //Split the tree around the new block, which becomes the root
+        root = tree_splay(root, ptr);
+        if(block_cmp(ptr, root) < 0){
+            GETLEFT(ptr) = GETLEFT(root);
+            GETRIGHT(ptr) = root;
+            GETLEFT(root) = NULL;
+        } else {
+            GETRIGHT(ptr) = GETRIGHT(root);
+            GETLEFT(ptr) = root;
+            GETRIGHT(root) = NULL;
+        }
+#endif
+    }
+    arena->free_seglist[index] = ptr;
+#if DEBUG
+    display_free(); 
+#endif
+}
+
+/*
+ * seglist_first - returns the block to use in a class where all blocks fit :
+ *     the head for LIFO lists, the lowest address or smallest block for trees
+ */
+void *seglist_first(int index){
+#if INSERT_POLICY == LIFO_INSERT
+    return arena->free_seglist[index];
+#else
+    return tree_first(arena->free_seglist[index]);
+#endif
+}
+
+/*
+ * seglist_fit - looks for a block of at least size bytes in a class,
+ *     looking at no more than probes blocks when the class isn't size-ordered
+ */
+void *seglist_fit(int index, size_t size, int probes){
+    void *free_block = arena->free_seglist[index];
+#if INSERT_POLICY == LIFO_INSERT
+    while(free_block != NULL && probes > 0) {
+        if(GETSIZE(*(size_t *)free_block) >= size) return free_block;
+        free_block = (void *)GETNEXTFREE(free_block);
+        probes--;
+    }
+    return NULL;
+#elif INSERT_POLICY == ADDRESS_INSERT
+    return tree_probe(free_block, size, &probes);
+#else
+    //Smallest block that fits
+    void *best = NULL;
+    while(free_block != NULL){
+        if(GETSIZE(*(size_t *)free_block) >= size){
+            best = free_block;
+            free_block = GETLEFT(free_block);
+        }
+        else free_block = GETRIGHT(free_block);
+    }
+    return best;
+#endif
+}
+
+#if INSERT_POLICY == ADDRESS_INSERT
+/*
+ * tree_largest - returns the size of the largest block of a tree
+ */
+static size_t tree_largest(void *node){
+    size_t largest = 0, size;
+    while(node != NULL){
+        if((size = GETSIZE(*(size_t *)node)) > largest) largest = size;
+        if((size = tree_largest(GETLEFT(node))) > largest) largest = size;
+        node = GETRIGHT(node);
+    }
+    return largest;
+}
+#endif
+
+/*
+ * seglist_largest - returns the size of the largest block of a class, 0 if
+ *     it is empty
+ */
+size_t seglist_largest(int index){
+    void *free_block = arena->free_seglist[index];
+    if(free_block == NULL) return 0;
+#if INSERT_POLICY == LIFO_INSERT
+    size_t largest = 0;
+    while(free_block != NULL){
+        if(GETSIZE(*(size_t *)free_block) > largest) largest = GETSIZE(*(size_t *)free_block);
+        free_block = (void *)GETNEXTFREE(free_block);
+    }
+    return largest;
+#elif INSERT_POLICY == ADDRESS_INSERT
+    return tree_largest(free_block);
+#else
+    //The rightmost block is the largest
+    while(GETRIGHT(free_block) != NULL) free_block = GETRIGHT(free_block);
+    return GETSIZE(*(size_t *)free_block);
+#endif
+}
+
+/*
+ * seglist_contains - tells if a free block is in its seglist class
+ */
+int seglist_contains(void *ptr){
+    void *free_block = arena->free_seglist[seglist_index(GETSIZE(*(size_t *)ptr))];
+    while(free_block != NULL){
+        if(free_block == ptr) return 1;
+#if INSERT_POLICY == LIFO_INSERT
+        free_block = (void *)GETNEXTFREE(free_block);
+#else
+        free_block = block_cmp(ptr, free_block) < 0 ? GETLEFT(free_block) : GETRIGHT(free_block);
+#endif
+    }
+    return 0;
+}
+
+/*
+ * mm_coalesce - coalesce a free block with the neighboring free blocks
+ *     The block must not be in the seglist. Its header and footer are
+ *     written, and the next block learns that its neighbor is now free.
+ */
+void mm_coalesce(void **header_ptr) {
+    void *ptr = *header_ptr;
+    size_t size = GETSIZE(*(size_t *)ptr);
+    size_t prev_dirty = GETPREVDIRTYBIT(*(size_t *)ptr);
+    void *next_header = ptr + size;
+    // The epilogue is marked allocated, so we never go past the heap
+    if(!GETDIRTYBIT(*(size_t *)next_header)){
+        //First, we'll remove this free block from the list of free blocks
+        remove_link(next_header);
+        //Now, coalesce
+        size += GETSIZE(*(size_t *)next_header);
+        arena->stats.coalesces++;
+        if(arena->sweep == next_header) arena->sweep = ptr;
+    }
+
+    if(!prev_dirty){
+        void *prev_header = ptr - GETSIZE(*(size_t *)GETPREVFOOTER(ptr));
+        //First, we'll remove this free block from the list of free blocks
+        remove_link(prev_header);
+        //Now, coalesce
+        size += GETSIZE(*(size_t *)prev_header);
+        prev_dirty = GETPREVDIRTYBIT(*(size_t *)prev_header);
+        if(arena->sweep == ptr) arena->sweep = prev_header;
+        ptr = prev_header;
+        arena->stats.coalesces++;
+    }
+    *(size_t *)ptr = size | prev_dirty;
+    *(size_t *)GETFOOTER(ptr) = size | prev_dirty;
+    *(size_t *)(ptr + size) &= ~(size_t)PREVDIRTYBIT;
+    *header_ptr = ptr;
+}
+
+/*
+ * mm_free - Free a block, giving it back to its run if it is a slab object.
+ *     Blocks of another arena are left to that arena, large blocks are unmapped.
+ */
+void mm_free(void *ptr)
+{
+    PROFILE_FREE(ptr);
+    arena_t *owner = arena_of(ptr);
+    if(owner == NULL){
+        if(ptr != NULL) large_free(ptr);
+        return;
+    }
+#if MM_THREADSAFE
+    thread_enter();
+    if(owner != arena){
+        remote_free(owner, ptr);
+        return;
+    }
+#endif
+#if SLAB
+    if(slab_owns(arena, ptr)){
+#if MM_THREADSAFE
+        tcache_free(ptr, slab_run(ptr)->class_index);
+#else
+        slab_free(ptr);
+#endif
+        return;
+    }
+#endif
+    LOCK();
+    heap_free(ptr);
+    UNLOCK();
+}
+
+/*
+ * mm_free_sized - Free a block of size bytes, the size last asked for it.
+ *     Slab objects go to the thread cache of the class of size, without
+ *     looking at their run.
+ */
+void mm_free_sized(void *ptr, size_t size)
+{
+#if SLAB && MM_THREADSAFE
+    if(ptr != NULL && size <= SLAB_MAX){
+        thread_enter();
+        if(arena_of(ptr) == arena && slab_owns(arena, ptr)){
+            PROFILE_FREE(ptr);
+            tcache_free(ptr, slab_class(size));
+            return;
+        }
+    }
+#endif
+    mm_free(ptr);
+}
+
+/*
+ * ptr_cmp - order of pointers by address, for qsort
+ */
+static int ptr_cmp(const void *a, const void *b){
+    void *x = *(void * const *)a;
+    void *y = *(void * const *)b;
+    if(x == y) return 0;
+    return x < y ? -1 : 1;
+}
+
+/*
+ * mm_free_batch - Free n blocks under a single lock. ptrs is sorted by
+ *     address, so that each run of adjacent heap blocks is merged into one
+ *     block, then coalesced and put in the seglist once.
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    size_t i, j;
+    if(n == 0) return;
+#if MM_PROFILE
+    if(ATOMIC_LOAD(&profile_live) != 0)
+        for(i = 0; i < n; i++) profile_forget(ptrs[i]);
+#endif
+    qsort(ptrs, n, sizeof(void *), ptr_cmp);
+#if MM_THREADSAFE
+    thread_enter();
+#endif
+    LOCK();
+    for(i = 0; i < n; i = j){
+        void *ptr = ptrs[i];
+        arena_t *owner = arena_of(ptr);
+        j = i + 1;
+        if(owner == NULL){
+            if(ptr != NULL) large_free(ptr);
+            continue;
+        }
+#if MM_THREADSAFE
+        if(owner != arena){
+            remote_free(owner, ptr);
+            continue;
+        }
+#endif
+#if SLAB
+        if(slab_owns(arena, ptr)){
+            slab_free(ptr);
+            continue;
+        }
+#endif
+        size_t *header = ptr - SIZE_T_SIZE;
+        if(GETDIRTYBIT(*header)){
+            size_t size = GETSIZE(*header);
+            while(j < n && ptrs[j] == ptr + size && GETDIRTYBIT(*(size_t *)(ptrs[j] - SIZE_T_SIZE))
+                  && !slab_owns(arena, ptrs[j])){
+                size += GETSIZE(*(size_t *)(ptrs[j] - SIZE_T_SIZE));
+                if(arena->sweep == ptrs[j] - SIZE_T_SIZE) arena->sweep = header;
+                j++;
+            }
+            *header = size | GETPREVDIRTYBIT(*header) | DIRTYBIT;
+            arena->stats.blocks_in_use -= j - i - 1;
+        }
+        heap_free(ptr);
+    }
+    UNLOCK();
+}
+
+/*
+ * heap_free - Free a block and coalesce it with its neighbors
+ */
+void heap_free(void *ptr)
+{
+    //first, lets define useful variables
+#if DEBUG
+    printf("Freeing at address %p\n", ptr);
+    mm_check();
+#endif 
+    void *header_ptr = ptr - SIZE_T_SIZE;
+
+    if(!GETDIRTYBIT(*(size_t *)header_ptr)){
+        printf("Warning : attempting to free a free block\n");
+        return;
+    }
+    arena->stats.blocks_in_use--;
+    if(arena->small_blocks > 0 && GETSIZE(*(size_t *)header_ptr) <= SLAB_HEAP_BLOCK) arena->small_blocks--;
+#if COALESCE_POLICY == DEFERRED_COALESCE
+    arena->touched = header_ptr;
+    if(quick_push(header_ptr)) return;
+#endif
+    heap_release(header_ptr);
+
+#if DEBUG
+//   display_free();
+#endif
+}
+
+/*
+ * heap_release - Coalesce a block that is no longer used with its free
+ *     neighbors, and give it to the seglist, or back to the system
+ */
+void heap_release(void *header_ptr)
+{
+    //Coalesce, this also clears the dirty bit
+    mm_coalesce(&header_ptr);
+    arena->touched = header_ptr;
+
+    //A large free block at the end of the heap goes back to the system
+    if(GETNEXTBLOCK(header_ptr) == GETEPILOGUE() && GETSIZE(*(size_t *)header_ptr) >= TRIM_THRESHOLD){
+        heap_trim(header_ptr);
+        return;
+    }
+
+    //Insert in free list
+    add_to_list(header_ptr);    
+}
+
+/*
+ * heap_fit - returns a free block of at least size bytes, as
+ *     get_optimal_free_block, or NULL. With deferred coalescing, the
+ *     blocks of the quick lists are coalesced first when none fits.
+ */
+void *heap_fit(size_t size)
+{
+    void *p = get_optimal_free_block(size);
+#if COALESCE_POLICY == DEFERRED_COALESCE
+    if(p == NULL && arena->stats.quick_blocks > 0){
+        quick_consolidate();
+        p = get_optimal_free_block(size);
+    }
+#endif
+    return p;
+}
+
+#if COALESCE_POLICY == DEFERRED_COALESCE
+/*
+ * quick_push - Keep a freed block in the quick list of its size. It stays
+ *     marked allocated, so that nothing coalesces with it, until a request
+ *     of the same size takes it or quick_consolidate frees it for good.
+ *     Returns 0 if the block is too large for a quick list.
+ */
+int quick_push(void *header_ptr)
+{
+    size_t size = GETSIZE(*(size_t *)header_ptr);
+    if(size > QUICK_MAX) return 0;
+    void **list = &arena->quick_lists[(size - MIN_BLOCK_SIZE) / ALIGNMENT];
+    *(void **)(header_ptr + SIZE_T_SIZE) = *list;
+    *list = header_ptr;
+    arena->stats.quick_blocks++;
+    arena->stats.quick_size += size;
+    //Memory that only serves one size is fragmentation : past a share of the heap, coalesce it
+    if(arena->stats.quick_size > (size_t)(arena->brk - arena->lo) / QUICK_RATIO) quick_consolidate();
+    return 1;
+}
+
+/*
+ * quick_pop - returns the header of a block of exactly size bytes taken
+ *     from its quick list, or NULL
+ */
+void *quick_pop(size_t size)
+{
+    if(size > QUICK_MAX) return NULL;
+    void **list = &arena->quick_lists[(size - MIN_BLOCK_SIZE) / ALIGNMENT];
+    void *header_ptr = *list;
+    if(header_ptr == NULL) return NULL;
+    *list = *(void **)(header_ptr + SIZE_T_SIZE);
+    *(size_t *)header_ptr &= ~(size_t)REALLOCBIT;
+    arena->stats.quick_blocks--;
+    arena->stats.quick_size -= size;
+    return header_ptr;
+}
+
+/*
+ * quick_consolidate - empty the quick lists : their blocks are coalesced
+ *     with their free neighbors and go to the seglist
+ */
+void quick_consolidate()
+{
+    int i;
+    for(i = 0; i < QUICK_CLASSES; i++){
+        while(arena->quick_lists[i] != NULL){
+            void *header_ptr = arena->quick_lists[i];
+            arena->quick_lists[i] = *(void **)(header_ptr + SIZE_T_SIZE);
+            arena->stats.quick_blocks--;
+            arena->stats.quick_size -= GETSIZE(*(size_t *)header_ptr);
+            heap_release(header_ptr);
+        }
+    }
+}
+#endif
+
+/*
+ * heap_trim - shrinks the heap to TRIM_PAD bytes past the start of its
+ *     last block, which is free and in no list
+ */
+void heap_trim(void *header_ptr)
+{
+    size_t size = GETSIZE(*(size_t *)header_ptr);
+    size_t prev_dirty = GETPREVDIRTYBIT(*(size_t *)header_ptr);
+    size_t keep = (size_t)(heap_chunk_end(header_ptr + ALIGN(TRIM_PAD)) - header_ptr);
+    if(keep < MIN_BLOCK_SIZE) keep = 0;
+    if(keep >= size || !arena_shrink(size - keep)){
+        add_to_list(header_ptr);
+        return;
+    }
+    if(keep > 0){
+        *(size_t *)header_ptr = keep | prev_dirty;
+        *(size_t *)GETFOOTER(header_ptr) = keep | prev_dirty;
+        add_to_list(header_ptr);
+        *(size_t *)GETEPILOGUE() = DIRTYBIT;
+    }
+    else *(size_t *)GETEPILOGUE() = DIRTYBIT | prev_dirty;
+}
+
+/*
+ * large_malloc - Allocate a block in a mapping of its own, with a header
+ *     holding the size of the mapping
+ */
+void *large_malloc(size_t size)
+{
+    size_t page = mem_pagesize();
+    // Larger sizes would wrap the size of the mapping
+    if(size > (size_t)-1 - SIZE_T_SIZE - page) return NULL;
+    size_t map_size = (size + SIZE_T_SIZE + page - 1) & ~(page - 1);
+    void *map = mem_mmap(map_size);
+    if(map == NULL) return NULL;
+    *(size_t *)map = map_size | DIRTYBIT;
+    ATOMIC_ADD(&large_blocks, 1);
+    ATOMIC_ADD(&large_size, map_size);
+    return map + SIZE_T_SIZE;
+}
+
+/*
+ * large_map - returns the mapping of a large block : its header is in the
+ *     first page, after the padding of an aligned block
+ */
+static inline void *large_map(void *ptr)
+{
+    return (void *)(((uintptr_t)ptr - SIZE_T_SIZE) & ~(uintptr_t)(mem_pagesize() - 1));
+}
+
+/*
+ * large_free - Give the mapping of a large block back to the system
+ */
+void large_free(void *ptr)
+{
+    void *map = large_map(ptr);
+    size_t map_size = GETSIZE(*(size_t *)(ptr - SIZE_T_SIZE));
+    if(mem_munmap(map, map_size) < 0){
+        printf("Warning : attempting to free an unknown block\n");
+        return;
+    }
+    ATOMIC_ADD(&large_blocks, -1);
+    ATOMIC_ADD(&large_size, -map_size);
+}
+
+/*
+ * large_realloc - Resize a large block : it stays in place while it fits
+ *     in its mapping without wasting most of it, else its pages are
+ *     remapped, and it is only copied when it is no longer large
+ */
+void *large_realloc(void *ptr, size_t newsize)
+{
+    void *map = large_map(ptr);
+    size_t pad = ptr - map;
+    size_t old_map_size = GETSIZE(*(size_t *)(ptr - SIZE_T_SIZE));
+    size_t payload_size = old_map_size - pad;
+    if(newsize >= MMAP_THRESHOLD){
+        size_t page = mem_pagesize();
+        if(newsize > (size_t)-1 - pad - page) return NULL;
+        size_t map_size = (newsize + pad + page - 1) & ~(page - 1);
+        if(newsize <= payload_size && map_size >= old_map_size / 2) return ptr;
+        void *new_map = mem_mremap(map, old_map_size, map_size);
+        if(new_map != NULL){
+            //The padding moves with the pages, so the alignment is kept
+            *(size_t *)(new_map + pad - SIZE_T_SIZE) = map_size | DIRTYBIT;
+            ATOMIC_ADD(&large_size, map_size - old_map_size);
+            return new_map + pad;
+        }
+    }
+    void *newptr = mm_malloc(newsize);
+    if(newptr == NULL) return NULL;
+    memcpy(newptr, ptr, newsize < payload_size ? newsize : payload_size);
+    large_free(ptr);
+    return newptr;
+}
+
+/*
+ * large_memalign - Allocate a large block whose payload starts on an
+ *     alignment boundary, at most a page : the header sits right before it
+ */
+void *large_memalign(size_t alignment, size_t size)
+{
+    size_t page = mem_pagesize();
+    if(size > (size_t)-1 - alignment - page) return NULL;
+    size_t map_size = (size + alignment + page - 1) & ~(page - 1);
+    void *map = mem_mmap(map_size);
+    if(map == NULL) return NULL;
+    *(size_t *)(map + alignment - SIZE_T_SIZE) = map_size | DIRTYBIT;
+    ATOMIC_ADD(&large_blocks, 1);
+    ATOMIC_ADD(&large_size, map_size);
+    return map + alignment;
+}
+
+/*
+ * aligned_header - returns the header of the first block starting in the free
+ *     block at start whose payload starts offset bytes after an align
+ *     boundary, leaving room for a free block in front if it isn't start
+ */
+static inline void *aligned_header(void *start, size_t align, size_t offset){
+    uintptr_t header = (uintptr_t)start + SIZE_T_SIZE - offset;
+    header = ((header + align - 1) & ~(uintptr_t)(align - 1)) - SIZE_T_SIZE + offset;
+    while(header != (uintptr_t)start && header - (uintptr_t)start < MIN_BLOCK_SIZE) header += align;
+    return (void *)header;
+}
+
+/*
+ * aligned_probe - looks at up to *probes blocks of a class for one that holds
+ *     an aligned block of size bytes
+ */
+static void *aligned_probe(void *node, size_t size, size_t align, size_t offset, int *probes){
+    while(node != NULL && *probes > 0){
+        (*probes)--;
+        if(aligned_header(node, align, offset) + size <= node + GETSIZE(*(size_t *)node)) return node;
+#if INSERT_POLICY == LIFO_INSERT
+        node = (void *)GETNEXTFREE(node);
+#else
+        void *found = aligned_probe(GETLEFT(node), size, align, offset, probes);
+        if(found != NULL) return found;
+        node = GETRIGHT(node);
+#endif
+    }
+    return NULL;
+}
+
+/*
+ * aligned_fit - returns a free block holding an aligned block of size bytes
+ *     without the slack of a worst case fit, or NULL. Only the classes below
+ *     those heap_fit would look at are probed.
+ */
+static void *aligned_fit(size_t size, size_t align, size_t offset){
+    int probes = ALIGNED_PROBES;
+    int index, last = seglist_index(size + align + MIN_BLOCK_SIZE);
+    for(index = seglist_index(size); index <= last && probes > 0; index++){
+        void *found = aligned_probe(arena->free_seglist[index], size, align, offset, &probes);
+        if(found != NULL) return found;
+    }
+    return NULL;
+}
+
+/*
+ * alloc_aligned - allocates a block whose payload of size bytes starts
+ *     offset bytes after an align boundary (align is a power of two).
+ *     The block is carved from a free block, or from the top of the heap,
+ *     and the leading and trailing remainders go back to the seglist.
+ */
+void *alloc_aligned(size_t size, size_t align, size_t offset){
+    // Larger ones would wrap the size of the region looked for
+    if(size > HEAP_MAX_REQUEST || align > HEAP_MAX_REQUEST) return NULL;
+    size_t new_size = ALIGN(size + SIZE_T_SIZE);
+    if(new_size < MIN_BLOCK_SIZE) new_size = MIN_BLOCK_SIZE;
+
+    // The free region we will carve the block from : one where it fits
+    // exactly, such as a freed run, else one large enough for any alignment
+    void *start = aligned_fit(new_size, align, offset);
+    if(start == NULL) start = heap_fit(new_size + align + MIN_BLOCK_SIZE);
+    void *end;
+    void *epilogue = GETEPILOGUE();
+    if(start != NULL){
+        remove_link(start);
+        end = start + GETSIZE(*(size_t *)start);
+    }
+    else {
+        //Use the top of the heap, with the last block if it is free
+        start = epilogue;
+        end = epilogue;
+        if(!GETPREVDIRTYBIT(*(size_t *)epilogue)){
+            start = epilogue - GETSIZE(*(size_t *)GETPREVFOOTER(epilogue));
+            remove_link(start);
+        }
+    }
+    size_t prev_dirty = GETPREVDIRTYBIT(*(size_t *)start);
+
+    //Header of the new block, leaving room for a free block in front if we move it
+    void *new_header = aligned_header(start, align, offset);
+
+    if(new_header + new_size > end){
+        //Only happens at the top of the heap
+        if(heap_grow(new_header + new_size - end) == (void *)-1){
+            if(start != end) add_to_list(start);
+            return NULL;
+        }
+        end = GETEPILOGUE();
+    }
+    if((size_t)(end - (new_header + new_size)) < SPLIT_SIZE) new_size = end - new_header;
+
+    if(new_header != start){
+        //The leading part becomes a free block
+        *(size_t *)start = (new_header - start) | prev_dirty;
+        *(size_t *)GETFOOTER(start) = *(size_t *)start;
+        add_to_list(start);
+        arena->stats.splits++;
+        *(size_t *)new_header = new_size | DIRTYBIT;
+    }
+    else *(size_t *)new_header = new_size | prev_dirty | DIRTYBIT;
+
+    void *tail = new_header + new_size;
+    if(tail != end){
+        //The trailing part becomes a free block, its next neighbor already knows
+        *(size_t *)tail = (end - tail) | PREVDIRTYBIT;
+        *(size_t *)GETFOOTER(tail) = *(size_t *)tail;
+        add_to_list(tail);
+        arena->stats.splits++;
+    }
+    if(end >= epilogue) *(size_t *)GETEPILOGUE() = DIRTYBIT | (tail == end ? PREVDIRTYBIT : 0);
+    else if(tail == end) *(size_t *)end |= PREVDIRTYBIT;
+    arena->stats.blocks_in_use++;
+    arena->touched = new_header;
+    return new_header + SIZE_T_SIZE;
+}
+
+/*
+ * slab_class - returns the slab class of a small size
+ */
+int slab_class(size_t size){
+    if(size <= 128) return (size + 15) / 16 - 1 + (size == 0);
+    return (size - 128 + 31) / 32 + 7;
+}
+
+/*
+ * slab_class_size - returns the size of the objects of a slab class
+ */
+size_t slab_class_size(int class_index){
+    if(class_index < 8) return 16 * (class_index + 1);
+    return 128 + 32 * (class_index - 7);
+}
+
+/*
+ * slab_page - index of the RUN_SIZE page holding ptr, counted from the start
+ *     of the heap of its arena
+ */
+static inline size_t slab_page(arena_t *owner, void *ptr){
+    return (uintptr_t)ptr / RUN_SIZE - (uintptr_t)owner->lo / RUN_SIZE;
+}
+
+/*
+ * slab_owns - tells if ptr, a block of the owner arena, is an object of a run
+ *     This doesn't need the lock in thread-safe mode : the page of a live
+ *     pointer can't change, and old pagemaps are never freed.
+ */
+int slab_owns(arena_t *owner, void *ptr){
+    size_t *pagemap = ATOMIC_LOAD(&owner->slab_pagemap);
+    if(pagemap == NULL || ptr < owner->lo) return 0;
+    size_t page = slab_page(owner, ptr);
+    if(page >= PAGEMAP_PAGES(pagemap)) return 0;
+    return (ATOMIC_LOAD(&PAGEMAP_BITS(pagemap)[page / 32]) >> (page % 32)) & 1;
+}
+
+/*
+ * slab_mark - sets or clears the pagemap bit of a run, growing the pagemap
+ *     if the run lies past its end
+ */
+int slab_mark(run_t *run, int is_run){
+    size_t page = slab_page(arena, run);
+    size_t old_pages = arena->slab_pagemap == NULL ? 0 : PAGEMAP_PAGES(arena->slab_pagemap);
+    if(page >= old_pages){
+        // Grow geometrically, the pagemap is a regular heap block
+        size_t pages = 2 * old_pages;
+        if(pages < PAGEMAP_MIN_PAGES) pages = PAGEMAP_MIN_PAGES;
+        while(pages <= page) pages *= 2;
+        size_t *pagemap = heap_malloc(sizeof(size_t) + pages / 8);
+        if(pagemap == NULL) return 0;
+        PAGEMAP_PAGES(pagemap) = pages;
+        memset(PAGEMAP_BITS(pagemap), 0, pages / 8);
+        if(arena->slab_pagemap != NULL){
+            memcpy(PAGEMAP_BITS(pagemap), PAGEMAP_BITS(arena->slab_pagemap), old_pages / 8);
+#if !MM_THREADSAFE
+            // Lock-free readers may still look at it in thread-safe mode
+            heap_free(arena->slab_pagemap);
+#endif
+        }
+        ATOMIC_STORE(&arena->slab_pagemap, pagemap);
+    }
+    unsigned int *word = &PAGEMAP_BITS(arena->slab_pagemap)[page / 32];
+    if(is_run) ATOMIC_STORE(word, *word | (1U << (page % 32)));
+    else ATOMIC_STORE(word, *word & ~(1U << (page % 32)));
+    return 1;
+}
+
+/*
+ * slab_unlink - removes a run from the list of runs with free slots
+ */
+static void slab_unlink(run_t *run){
+    if(run->prev != NULL) run->prev->next = run->next;
+    else arena->slab_runs[run->class_index] = run->next;
+    if(run->next != NULL) run->next->prev = run->prev;
+    run->prev = run->next = NULL;
+}
+
+/*
+ * slab_push - adds a run in front of the list of runs with free slots
+ */
+static void slab_push(run_t *run){
+    run->prev = NULL;
+    run->next = arena->slab_runs[run->class_index];
+    if(run->next != NULL) run->next->prev = run;
+    arena->slab_runs[run->class_index] = run;
+}
+
+/*
+ * slab_malloc - Allocate a small object from a run of its class
+ *     Objects have no header : the pagemap tells mm_free which pointers
+ *     belong to runs, and run blocks are aligned so the run of an object is
+ *     found by masking its address.
+ */
+void *slab_malloc(size_t size){
+    int class_index = slab_class(size);
+    run_t *run = arena->slab_runs[class_index];
+    if(run == NULL){
+        //Few small objects yet : a block of the heap serves better than a run
+        if(arena->stats.slab_objects + arena->small_blocks < SLAB_MIN_OBJECTS){
+            void *p = heap_malloc(size);
+            if(p != NULL) arena->small_blocks++;
+            return p;
+        }
+        //No free slot in this class, get a new run from the heap
+        //The block header of the run is on the page boundary, so that runs can be next to each other
+        run = alloc_aligned(RUN_SIZE - SIZE_T_SIZE, RUN_SIZE, SIZE_T_SIZE);
+        if(run == NULL) return NULL;
+        if(!slab_mark(run, 1)){
+            heap_free(run);
+            return NULL;
+        }
+        size_t obj_size = slab_class_size(class_index);
+        int i;
+        run->class_index = class_index;
+        run->capacity = (RUN_SIZE - SIZE_T_SIZE - RUN_HEADER_SIZE) / obj_size;
+        run->free_count = run->capacity;
+        for(i = 0; i < RUN_MAP_WORDS; i++){
+            int first = i * 32;
+            if(first + 32 <= run->capacity) run->map[i] = ~0U;
+            else if(first < run->capacity) run->map[i] = (1U << (run->capacity - first)) - 1;
+            else run->map[i] = 0;
+        }
+        slab_push(run);
+    }
+
+    int word = 0;
+    while(run->map[word] == 0) word++;
+    int slot = word * 32 + __builtin_ctz(run->map[word]);
+    run->map[word] &= run->map[word] - 1;
+    if(--run->free_count == 0) slab_unlink(run);
+    arena->stats.slab_objects++;
+    arena->touched_run = run;
+    return (void *)run + RUN_HEADER_SIZE + slot * slab_class_size(class_index);
+}
+
+/*
+ * slab_free - Give a small object back to its run. Empty runs go back to
+ *     the heap, unless it is the only run of its class with free slots.
+ */
+void slab_free(void *ptr){
+    run_t *run = slab_run(ptr);
+    int slot = (ptr - (void *)run - RUN_HEADER_SIZE) / slab_class_size(run->class_index);
+    if((run->map[slot / 32] >> (slot % 32)) & 1){
+        printf("Warning : attempting to free a free block\n");
+        return;
+    }
+    run->map[slot / 32] |= 1U << (slot % 32);
+    arena->stats.slab_objects--;
+    arena->touched_run = run;
+    if(run->free_count++ == 0) slab_push(run);
+    if(run->free_count == run->capacity && (run->prev != NULL || run->next != NULL)){
+        slab_unlink(run);
+        slab_mark(run, 0);
+        heap_free(run);
+        arena->touched_run = NULL;
+    }
+}
+
+#if MM_THREADSAFE
+/*
+ * tcache_flush - gives count objects of a thread cache class back to the
+ *     slab, the caller holds the lock
+ */
+void tcache_flush(tcache_t *cache, int class_index, unsigned int count){
+    while(count-- > 0 && cache->bins[class_index] != NULL){
+        void *obj = cache->bins[class_index];
+        cache->bins[class_index] = *(void **)obj;
+        cache->counts[class_index]--;
+        slab_free(obj);
+    }
+}
+
+/*
+ * tcache_destroy - gives the cache of an exiting thread back to the slab
+ */
+void tcache_destroy(void *arg){
+    tcache_t *cache = arg;
+    int i;
+    LOCK();
+    if(cache->epoch == heap_epoch)
+        for(i = 0; i < SLAB_CLASSES; i++) tcache_flush(cache, i, cache->counts[i]);
+    UNLOCK();
+}
+
+void tcache_key_init(){
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+ * tcache_malloc - Allocate a slab object from the thread cache, refilling
+ *     it from the slab by batches when it is empty
+ */
+void *tcache_malloc(int class_index){
+    tcache_t *cache = thread_enter();
+    void *obj = cache->bins[class_index];
+    if(obj == NULL){
+        int i;
+        LOCK();
+        for(i = 0; i < TCACHE_BATCH; i++){
+            obj = slab_malloc(slab_class_size(class_index));
+            if(obj == NULL) break;
+            if(!slab_owns(arena, obj)){
+                //A heap block, see slab_malloc : it isn't cached
+                if(i == 0){
+                    UNLOCK();
+                    return obj;
+                }
+                heap_free(obj);
+                break;
+            }
+            *(void **)obj = cache->bins[class_index];
+            cache->bins[class_index] = obj;
+            cache->counts[class_index]++;
+        }
+        UNLOCK();
+        obj = cache->bins[class_index];
+        if(obj == NULL) return NULL;
+    }
+    cache->bins[class_index] = *(void **)obj;
+    cache->counts[class_index]--;
+    return obj;
+}
+
+/*
+ * tcache_free - Keep a freed slab object in the thread cache, giving a
+ *     batch back to the slab when the cache of its class is full
+ */
+void tcache_free(void *ptr, int class_index){
+    tcache_t *cache = thread_enter();
+    if(cache->counts[class_index] >= TCACHE_MAX){
+        LOCK();
+        tcache_flush(cache, class_index, TCACHE_BATCH);
+        UNLOCK();
+    }
+    *(void **)ptr = cache->bins[class_index];
+    cache->bins[class_index] = ptr;
+    cache->counts[class_index]++;
+}
+#endif
+
+/*
+ * mm_stats - fills stats with the counters of every arena. Each arena is
+ *     only locked while its counters are read : this is O(MAXPOW) per arena,
+ *     but for the largest free block, looked for in the last non empty class.
+ */
+void mm_stats(struct mm_stats *stats){
+    arena_t *current = arena;
+    int i, j;
+    memset(stats, 0, sizeof(*stats));
+    for(i = 0; i < MM_ARENAS; i++){
+#if MM_THREADSAFE
+        if(ATOMIC_LOAD(&arenas[i].epoch) != heap_epoch) continue;
+#endif
+        arena = &arenas[i];
+        if(arena->slab_runs == NULL) continue;
+        LOCK();
+        size_t heap_size = arena->brk - arena->lo;
+        size_t free_size = 0;
+        for(j = 0; j < MM_STATS_CLASSES; j++){
+            stats->class_free[j] += arena->stats.class_free[j];
+            stats->class_blocks[j] += arena->stats.class_blocks[j];
+            stats->free_blocks += arena->stats.class_blocks[j];
+            free_size += arena->stats.class_free[j];
+        }
+        //Everything but the prologue, the epilogue, free blocks and blocks
+        //waiting in the quick lists is allocated
+        stats->heap_size += heap_size;
+        stats->free_size += free_size;
+        stats->in_use += heap_size - PROLOGUE_SIZE - SIZE_T_SIZE - free_size - arena->stats.quick_size;
+        stats->blocks_in_use += arena->stats.blocks_in_use;
+        stats->slab_objects += arena->stats.slab_objects;
+        stats->quick_blocks += arena->stats.quick_blocks;
+        stats->quick_size += arena->stats.quick_size;
+        stats->sbrk_calls += arena->stats.sbrk_calls;
+        stats->splits += arena->stats.splits;
+        stats->coalesces += arena->stats.coalesces;
+        if(arena->seglist_bitmap[0] != 0){
+            //The last non empty sub-class holds the largest block
+            int fl = 31 - __builtin_clz(arena->seglist_bitmap[0]);
+            int sl = 31 - __builtin_clz(arena->seglist_bitmap[1 + fl]);
+            size_t largest = seglist_largest(fl * SL_COUNT + sl);
+            if(largest > stats->largest_free) stats->largest_free = largest;
+        }
+        UNLOCK();
+    }
+    arena = current;
+    stats->large_blocks = ATOMIC_LOAD(&large_blocks);
+    stats->large_size = ATOMIC_LOAD(&large_size);
+}
+
+/*
+ * mm_snapshot - copies to state, of mm_snapshot_size bytes, what the
+ *     package keeps out of its heap : with the memory of memlib (see
+ *     mem_snapshot), it is the whole mem_sbrk heap. The mapped arenas and
+ *     the profiler are not saved, no other thread may use the package.
+ */
+void mm_snapshot(void *state){
+    mm_state_t *saved = state;
+    memcpy(&saved->arena, &arenas[0], ARENA_STATE_SIZE);
+    saved->large_blocks = large_blocks;
+    saved->large_size = large_size;
+#if MM_THREADSAFE
+    saved->heap_epoch = heap_epoch;
+    saved->tcache = tcache;
+#endif
+}
+
+/*
+ * mm_restore - puts back the state of mm_snapshot, once memlib restored
+ *     the heap of the same snapshot
+ */
+void mm_restore(const void *state){
+    const mm_state_t *saved = state;
+    // The heap has been written past the fresh mark of the snapshot since
+    void *fresh = arenas[0].fresh;
+    memcpy(&arenas[0], &saved->arena, ARENA_STATE_SIZE);
+    if(fresh > arenas[0].fresh) arenas[0].fresh = fresh;
+    large_blocks = saved->large_blocks;
+    large_size = saved->large_size;
+#if MM_THREADSAFE
+    heap_epoch = saved->heap_epoch;
+    tcache = saved->tcache;
+    arena = arenas;
+#endif
+}
+
+size_t mm_snapshot_size(){
+    return sizeof(mm_state_t);
+}
+
+#if MM_PROFILE
+#define PROFILE_LOCK() while(__atomic_test_and_set(&profile_lock, __ATOMIC_ACQUIRE))
+#define PROFILE_UNLOCK() __atomic_clear(&profile_lock, __ATOMIC_RELEASE)
+
+/*
+ * profile_hash - hash of an address, or of a word of a call stack
+ */
+static inline size_t profile_hash(size_t x){
+    return (x >> 4) * (size_t)0x9e3779b97f4a7c15ULL;
+}
+
+/*
+ * profile_interval - draws the bytes until the next sample, of mean rate :
+ *     -ln(u) * rate, which makes sampling a Poisson process over the bytes
+ *     allocated. ln is computed from the exponent and a short series on
+ *     the mantissa, so that the package needs no libm.
+ */
+static long profile_interval(size_t rate){
+    if(profile_rng == 0) profile_rng = (uintptr_t)&profile_rng * 0x2545f4914f6cdd1dULL | 1;
+    profile_rng ^= profile_rng >> 12;
+    profile_rng ^= profile_rng << 25;
+    profile_rng ^= profile_rng >> 27;
+    union { double d; uint64_t bits; } u;
+    u.d = (((profile_rng * 0x2545f4914f6cdd1dULL) >> 11) + 1) * (1.0 / 9007199254740992.0);
+    int e = (int)((u.bits >> 52) & 0x7ff) - 1023;
+    u.bits = (u.bits & (((uint64_t)1 << 52) - 1)) | ((uint64_t)1023 << 52);
+    double s = (u.d - 1) / (u.d + 1), s2 = s * s;
+    double ln = e * 0.69314718055994531 + 2 * s * (1 + s2 * (1.0 / 3 + s2 * (1.0 / 5 + s2 * (1.0 / 7 + s2 / 9))));
+    double interval = -ln * rate;
+    return interval < 1 ? 1 : (interval > (double)LONG_MAX / 2 ? LONG_MAX / 2 : (long)interval);
+}
+
+/*
+ * profile_grow - maps a table of count entries of size bytes, filled with
+ *     zeros, NULL if there is no memory left
+ */
+static void *profile_grow(size_t count, size_t size){
+    void *table = mmap(NULL, count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return table == MAP_FAILED ? NULL : table;
+}
+
+/*
+ * profile_slot - slot of the sample of ptr, or the empty slot it would go in
+ */
+static size_t profile_slot(void *ptr){
+    size_t mask = profile_samples_cap - 1, i = profile_hash((uintptr_t)ptr) & mask;
+    while(profile_samples[i].ptr != NULL && profile_samples[i].ptr != ptr) i = (i + 1) & mask;
+    return i;
+}
+
+/*
+ * profile_remove - empties the slot of a sample, and moves back the
+ *     samples after it that could no longer be found (linear probing)
+ */
+static void profile_remove(size_t i){
+    size_t mask = profile_samples_cap - 1, j, home;
+    profile_samples[i].ptr = NULL;
+    for(j = (i + 1) & mask; profile_samples[j].ptr != NULL; j = (j + 1) & mask){
+        home = profile_hash((uintptr_t)profile_samples[j].ptr) & mask;
+        if((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)){
+            profile_samples[i] = profile_samples[j];
+            profile_samples[j].ptr = NULL;
+            i = j;
+        }
+    }
+}
+
+/*
+ * profile_bucket - index of the bucket of a call stack, added if it is
+ *     new, -1 if there is no memory left. The caller holds the profile lock.
+ */
+static long profile_bucket(void **frames, int depth){
+    size_t hash = depth, mask, i;
+    int k;
+    for(k = 0; k < depth; k++) hash = profile_hash(hash ^ (uintptr_t)frames[k]) + k;
+    if(2 * (profile_num_buckets + 1) > profile_stacks_cap){
+        size_t cap = profile_stacks_cap ? 2 * profile_stacks_cap : 1024, *stacks = profile_grow(cap, sizeof(size_t));
+        if(stacks == NULL) return -1;
+        for(i = 0; i < profile_stacks_cap; i++){
+            size_t b = profile_stacks[i], j;
+            if(b == 0) continue;
+            bucket_t *bucket = &profile_buckets[b - 1];
+            size_t h = bucket->depth;
+            for(k = 0; k < bucket->depth; k++) h = profile_hash(h ^ (uintptr_t)bucket->frames[k]) + k;
+            for(j = h & (cap - 1); stacks[j] != 0; j = (j + 1) & (cap - 1));
+            stacks[j] = b;
+        }
+        if(profile_stacks != NULL) munmap(profile_stacks, profile_stacks_cap * sizeof(size_t));
+        profile_stacks = stacks;
+        profile_stacks_cap = cap;
     }
-    else if((void *)GETPREVFREE(ptr) == NULL){
-        GETPREVFREE((void *)GETNEXTFREE(ptr)) = (size_t) NULL;
-        free_seglist[seglist_index(GETSIZE(*(size_t *) ptr))] = (void *)GETNEXTFREE(ptr);
+    mask = profile_stacks_cap - 1;
+    for(i = hash & mask; profile_stacks[i] != 0; i = (i + 1) & mask){
+        bucket_t *bucket = &profile_buckets[profile_stacks[i] - 1];
+        if(bucket->depth == depth && !memcmp(bucket->frames, frames, depth * sizeof(void *)))
+            return profile_stacks[i] - 1;
     }
-    else{
-        GETNEXTFREE((void *)GETPREVFREE(ptr)) = GETNEXTFREE(ptr);
-        GETPREVFREE((void *)GETNEXTFREE(ptr)) = GETPREVFREE(ptr);
+    if(profile_num_buckets == profile_max_buckets){
+        size_t max = profile_max_buckets ? 2 * profile_max_buckets : 256;
+        bucket_t *buckets = profile_grow(max, sizeof(bucket_t));
+        if(buckets == NULL) return -1;
+        if(profile_buckets != NULL){
+            memcpy(buckets, profile_buckets, profile_num_buckets * sizeof(bucket_t));
+            munmap(profile_buckets, profile_max_buckets * sizeof(bucket_t));
+        }
+        profile_buckets = buckets;
+        profile_max_buckets = max;
     }
-#if DEBUG
-    display_free();
-#endif
+    bucket_t *bucket = &profile_buckets[profile_num_buckets];
+    memcpy(bucket->frames, frames, depth * sizeof(void *));
+    bucket->depth = depth;
+    profile_stacks[i] = ++profile_num_buckets;
+    return profile_num_buckets - 1;
 }
 
 /*
- * add_to_list - adds a link to the right seglist
+ * profile_sample - called by PROFILE_ALLOC when the countdown of the thread
+ *     runs out : records the call stack of the block, and draws the next
+ *     countdown. While the profiler is off, it only looks at the rate again
+ *     after PROFILE_IDLE more bytes, so that mm_profile_start is seen.
  */
-void add_to_list(void *ptr){
-#if DEBUG
-    printf("Adding %x, size of block is %lu\n", ptr, GETSIZE(*(size_t*)ptr));
-#endif
-    //Ordered blocks stategy
-    int index = seglist_index(GETSIZE(*(size_t *)ptr));
-    if(free_seglist[index] == NULL){
-        free_seglist[index] = ptr;
-        GETNEXTFREE(ptr) = (size_t)NULL;
-        GETPREVFREE(ptr) = (size_t)NULL;
-#if DEBUG
-    display_free();
-#endif
+void profile_sample(void *ptr, size_t size){
+    void *frames[PROFILE_FRAMES + 2];
+    size_t rate = ATOMIC_LOAD(&profile_rate), i;
+    if(profile_busy) return;
+    if(rate == 0){
+        profile_countdown = PROFILE_IDLE;
+        profile_rate_seen = 0;
+        return;
+    }
+    // The first countdown of a rate is drawn rather than sampling right away
+    if(profile_rate_seen != rate || ptr == NULL){
+        profile_rate_seen = rate;
+        profile_countdown = profile_interval(rate);
         return;
     }
+    profile_countdown = profile_interval(rate);
 
-    //Now, we'll find the spot to insert this free block
-    void *free_slot = free_seglist[index];
-    while(GETNEXTFREE(free_slot) != (size_t)NULL && GETSIZE(GETNEXTFREE(free_slot)) < GETSIZE(*(size_t *)ptr)) free_slot = (void *)GETNEXTFREE(free_slot);
-    GETNEXTFREE(ptr) = GETNEXTFREE(free_slot);
-    GETPREVFREE(ptr) = (size_t)free_slot;
-    if(GETNEXTFREE(free_slot) != (size_t)NULL) GETPREVFREE((void *)GETNEXTFREE(free_slot)) = (size_t)ptr;
-    GETNEXTFREE(free_slot) = (size_t)ptr;
-#if DEBUG
-    display_free(); 
-#endif
+    // backtrace may allocate the first time, the profiler is then not reentered
+    profile_busy++;
+    int depth = backtrace(frames, PROFILE_FRAMES + 2) - 2;
+    profile_busy--;
+    if(depth <= 0) return;
+
+    PROFILE_LOCK();
+    long b = profile_bucket(frames + 2, depth);
+    if(b < 0 || 2 * (ATOMIC_LOAD(&profile_live) + 1) > profile_samples_cap){
+        // Not enough room : rehash the samples in a table twice as large
+        size_t cap = profile_samples_cap ? 2 * profile_samples_cap : 1024;
+        sample_t *old = profile_samples, *samples = b < 0 ? NULL : profile_grow(cap, sizeof(sample_t));
+        if(samples == NULL){
+            PROFILE_UNLOCK();
+            return;
+        }
+        profile_samples = samples;
+        profile_samples_cap = cap;
+        for(i = 0; old != NULL && i < cap / 2; i++)
+            if(old[i].ptr != NULL) profile_samples[profile_slot(old[i].ptr)] = old[i];
+        if(old != NULL) munmap(old, cap / 2 * sizeof(sample_t));
+    }
+    bucket_t *bucket = &profile_buckets[b];
+    bucket->alloc_count++;
+    bucket->alloc_bytes += size;
+    bucket->live_count++;
+    bucket->live_bytes += size;
+    i = profile_slot(ptr);
+    if(profile_samples[i].ptr == NULL){
+        unsigned char *count = &profile_filter[profile_hash((uintptr_t)ptr) % PROFILE_FILTER];
+        if(*count < 255) ATOMIC_STORE(count, *count + 1);
+        ATOMIC_STORE(&profile_live, profile_live + 1);
+    }
+    else {
+        // Freed without mm_free seeing it, by an mm_init
+        profile_buckets[profile_samples[i].bucket].live_count--;
+        profile_buckets[profile_samples[i].bucket].live_bytes -= profile_samples[i].size;
+    }
+    profile_samples[i].ptr = ptr;
+    profile_samples[i].size = size;
+    profile_samples[i].bucket = b;
+    PROFILE_UNLOCK();
 }
 
 /*
- * mm_coalesce - coalesce a free block with the neighboring free blocks
+ * profile_forget - called by PROFILE_FREE while there are samples : if the
+ *     block is one, it is no longer live. Most blocks are not, which the
+ *     filter tells without the lock.
  */
-void mm_coalesce(void **header_ptr) {
-    void *start = mem_heap_lo() + ALIGN(MAXPOW * sizeof(void *));
-    void *end = mem_heap_hi();
-    void *next_header = *header_ptr + GETSIZE(*(size_t *)*header_ptr);
-    if(next_header < end && !GETDIRTYBIT(*(size_t *)next_header)){
-        //First, we'll remove this free block from the list of free blocks
-        remove_link(next_header);
-        //Now, coalesce
-        *(size_t *)*header_ptr += GETSIZE(*(size_t *)next_header);
-        *(size_t *)GETFOOTER(next_header) = *(size_t *)*header_ptr;
+void profile_forget(void *ptr){
+    if(ptr == NULL) return;
+    unsigned char *count = &profile_filter[profile_hash((uintptr_t)ptr) % PROFILE_FILTER];
+    if(ATOMIC_LOAD(count) == 0) return;
+    PROFILE_LOCK();
+    if(profile_samples_cap != 0){
+        size_t i = profile_slot(ptr);
+        if(profile_samples[i].ptr != NULL){
+            profile_buckets[profile_samples[i].bucket].live_count--;
+            profile_buckets[profile_samples[i].bucket].live_bytes -= profile_samples[i].size;
+            profile_remove(i);
+            if(*count < 255) ATOMIC_STORE(count, *count - 1);
+            ATOMIC_STORE(&profile_live, profile_live - 1);
+        }
     }
+    PROFILE_UNLOCK();
+}
 
-    void *footer = GETFOOTER(*header_ptr);
-    void *prev_footer = footer - GETSIZE(*(size_t *)footer);
-    if (prev_footer <= start) return;
-    void *prev_header = prev_footer - GETSIZE(*(size_t *)prev_footer) + SIZE_T_SIZE;
-    if(!GETDIRTYBIT(*(size_t *)prev_header)){
-        //First, we'll remove this free block from the list of free blocks
-        remove_link(prev_header);
-        //Now, coalesce
-        *(size_t *)prev_header += GETSIZE(*(size_t*)*header_ptr);
-        *(size_t *)footer = *(size_t *)prev_header;
-        *header_ptr = prev_header;
+/*
+ * profile_reset - forgets the live samples, when mm_init starts a new heap
+ */
+void profile_reset(){
+    size_t i;
+    PROFILE_LOCK();
+    if(profile_samples != NULL)
+        memset(profile_samples, 0, profile_samples_cap * sizeof(sample_t));
+    memset(profile_filter, 0, sizeof(profile_filter));
+    for(i = 0; i < profile_num_buckets; i++){
+        profile_buckets[i].live_count = 0;
+        profile_buckets[i].live_bytes = 0;
     }
+    ATOMIC_STORE(&profile_live, 0);
+    PROFILE_UNLOCK();
 }
+#endif
 
 /*
- * mm_free - Freeing a block does nothing.
+ * mm_profile_start - starts sampling about one block per rate bytes
+ *     allocated, or stops if rate is 0. Threads see a new rate on their
+ *     next sample, or within PROFILE_IDLE bytes if the profiler was off.
  */
-void mm_free(void *ptr)
-{
-    //first, lets define useful variables
-#if DEBUG
-    printf("Freeing at address %x\n", ptr);
-    mm_check();
-#endif 
-    void *header_ptr = ptr - SIZE_T_SIZE;
+void mm_profile_start(size_t rate){
+#if MM_PROFILE
+    void *frame;
+    // The first backtrace loads what it needs, which allocates
+    profile_busy++;
+    backtrace(&frame, 1);
+    profile_busy--;
+    ATOMIC_STORE(&profile_rate, rate);
+    if(rate != 0) profile_countdown = 0;
+#endif
+}
 
-    if(!GETDIRTYBIT(*(size_t *)header_ptr)){
-        printf("Warning : attempting to free a free block\n");
-        return;
+/*
+ * mm_profile_dump - writes the profile to path, in the legacy heap format
+ *     of pprof : the bytes and blocks live and allocated by every sampled
+ *     call stack, then the mappings of the process to symbolize them.
+ *     The counts are those of the samples, pprof scales them with the rate.
+ *     Returns 0, or -1 if the file can't be written or MM_PROFILE is 0.
+ */
+int mm_profile_dump(const char *path){
+#if MM_PROFILE
+    char buf[64 + 20 * PROFILE_FRAMES];
+    size_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0, i;
+    int fd, maps, k, len, ok = 1;
+    ssize_t n;
+    if((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) return -1;
+    // Nothing here allocates, but stdio would
+    PROFILE_LOCK();
+    for(i = 0; i < profile_num_buckets; i++){
+        live_count += profile_buckets[i].live_count;
+        live_bytes += profile_buckets[i].live_bytes;
+        alloc_count += profile_buckets[i].alloc_count;
+        alloc_bytes += profile_buckets[i].alloc_bytes;
     }
+    len = snprintf(buf, sizeof(buf), "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%zu\n",
+                   live_count, live_bytes, alloc_count, alloc_bytes, ATOMIC_LOAD(&profile_rate));
+    ok = write(fd, buf, len) == len;
+    for(i = 0; i < profile_num_buckets && ok; i++){
+        bucket_t *bucket = &profile_buckets[i];
+        len = snprintf(buf, sizeof(buf), "%6zu: %8zu [%6zu: %8zu] @",
+                       bucket->live_count, bucket->live_bytes, bucket->alloc_count, bucket->alloc_bytes);
+        for(k = 0; k < bucket->depth; k++) len += snprintf(buf + len, sizeof(buf) - len, " %p", bucket->frames[k]);
+        buf[len++] = '\n';
+        ok = write(fd, buf, len) == len;
+    }
+    PROFILE_UNLOCK();
+    if(ok && (ok = write(fd, "\nMAPPED_LIBRARIES:\n", 19) == 19) && (maps = open("/proc/self/maps", O_RDONLY)) >= 0){
+        while(ok && (n = read(maps, buf, sizeof(buf))) > 0) ok = write(fd, buf, n) == n;
+        close(maps);
+    }
+    return close(fd) == 0 && ok ? 0 : -1;
+#else
+    return -1;
+#endif
+}
 
-    //Coalesce
-    mm_coalesce(&header_ptr);
-
-    //Insert in free list
-    add_to_list(header_ptr);    
+/*
+ * mm_fork_prepare - takes the locks of all arenas, then of the profiler,
+ *     before a fork : the child then gets none held by a thread it doesn't have
+ */
+void mm_fork_prepare(){
+#if MM_THREADSAFE
+    int i;
+    for(i = 0; i < MM_ARENAS; i++) pthread_mutex_lock(&arenas[i].lock);
+#endif
+#if MM_PROFILE
+    PROFILE_LOCK();
+#endif
+}
 
-    //change flag
-    *(size_t*)header_ptr &= -2;
+/*
+ * mm_fork_parent - gives back the locks of mm_fork_prepare in the parent
+ */
+void mm_fork_parent(){
+#if MM_PROFILE
+    PROFILE_UNLOCK();
+#endif
+#if MM_THREADSAFE
+    int i;
+    for(i = MM_ARENAS - 1; i >= 0; i--) pthread_mutex_unlock(&arenas[i].lock);
+#endif
+}
 
-#if DEBUG
-//   display_free();
+/*
+ * mm_fork_child - sets up the locks of mm_fork_prepare anew in the child,
+ *     whose only thread is the one that forked
+ */
+void mm_fork_child(){
+#if MM_PROFILE
+    profile_lock = 0;
+#endif
+#if MM_THREADSAFE
+    arena_locks_init();
 #endif
 }
 
 /*
- * mm_check - check and verify the integrity of the heap and the surrounding parameters
+ * mm_check - check and verify the integrity of the heap of every arena
  */
 void mm_check(){
+    arena_t *current = arena;
+    int i;
+    for(i = 0; i < MM_ARENAS; i++){
+#if MM_THREADSAFE
+        if(arenas[i].epoch != heap_epoch) continue;
+#endif
+        arena = &arenas[i];
+        LOCK();
+        check_arena();
+        UNLOCK();
+    }
+    arena = current;
+}
+
+/*
+ * check_arena - check and verify the integrity of the heap and the surrounding parameters
+ */
+void check_arena(){
     //Are all blocks in the free list marked as free ?
     int flist = 0;
     int i = 0;
     int sizepb = 0;
-    for(i = 0; i < MAXPOW; i++){
-        void *current_free_block = free_seglist[i];
-        while(current_free_block != NULL){
-            if(GETDIRTYBIT(*(size_t *)current_free_block)){
-                flist = 1;
-                break;
-            }
-            if(GETSIZE(*(size_t *)current_free_block) < 1<<(i+5)){
-                sizepb = 1;
-                break;
-            }
-            current_free_block = (void *)GETNEXTFREE(current_free_block);
-        }
+    int bitmappb = 0;
+    int linkpb = 0;
+    for(i = 0; i < NUM_CLASSES; i++){
+        void *current_free_block = arena->free_seglist[i];
+        int bit = (arena->seglist_bitmap[1 + i / SL_COUNT] >> (i % SL_COUNT)) & 1;
+        if(bit != (current_free_block != NULL)) bitmappb = 1;
+        if(((arena->seglist_bitmap[0] >> (i / SL_COUNT)) & 1) != (arena->seglist_bitmap[1 + i / SL_COUNT] != 0)) bitmappb = 1;
+        int pb = check_class(current_free_block, i, NULL, NULL);
+        if(pb & 1) flist = 1;
+        if(pb & 2) sizepb = 1;
+        if(pb & 4) linkpb = 1;
     }
 
     //Are all free blocks coalesced ?
     int coald = 0;
-    void *start = mem_heap_lo() + ALIGN(MAXPOW*sizeof(void *));
-    void *end = mem_heap_hi();
-    if(start != end){
-        void *current_block = GETNEXTBLOCK(start);
-        int prev_type = (int)GETDIRTYBIT(*(size_t *)start);
-        while(current_block < end){
-            if(prev_type == 0 && prev_type == (int)GETDIRTYBIT(*(size_t *)current_block)){
-                coald = 1;
-                break;
-            }
-            prev_type = (int)GETDIRTYBIT(*(size_t *)current_block);
-            current_block = GETNEXTBLOCK(current_block);
+    void *start = arena->lo + PROLOGUE_SIZE;
+    void *end = GETEPILOGUE();
+    void *current_block = start;
+    int prev_type = 1;
+    while(current_block < end){
+        if(prev_type == 0 && prev_type == (int)GETDIRTYBIT(*(size_t *)current_block)){
+            coald = 1;
+            break;
         }
+        prev_type = (int)GETDIRTYBIT(*(size_t *)current_block);
+        current_block = GETNEXTBLOCK(current_block);
     }
 
     //Are all free blocks in the list ? 
     int finlist = 0;
-    if(start != end){
-        void *current_block = GETNEXTBLOCK(start);
-        while(current_block < end){
-            if(GETDIRTYBIT(*(size_t *)current_block) == 0){
-                void *current_free_block = free_seglist[seglist_index(GETSIZE(*(size_t *)current_block))];
-                while(current_free_block != NULL){
-                    if(current_free_block == current_block) break;
-                    current_free_block = (void *)GETNEXTFREE(current_free_block);
-                }
-                if(current_free_block == NULL){
-                    finlist = 1;
-                    break;
-                }
+    size_t class_free[MM_STATS_CLASSES] = {0};
+    size_t blocks_in_use = 0;
+    current_block = start;
+    while(current_block < end){
+        if(GETDIRTYBIT(*(size_t *)current_block) == 0){
+            if(!seglist_contains(current_block)){
+                finlist = 1;
+                break;
             }
-            current_block = GETNEXTBLOCK(current_block);
+            class_free[STATS_CLASS(seglist_index(GETSIZE(*(size_t *)current_block)))] += GETSIZE(*(size_t *)current_block);
         }
+        else blocks_in_use++;
+        current_block = GETNEXTBLOCK(current_block);
+    }
+
+    //Do the counters of mm_stats match the heap ? Blocks of the quick lists are marked allocated
+    int statspb = !finlist && blocks_in_use != arena->stats.blocks_in_use + arena->stats.quick_blocks;
+    for(i = 0; i < MM_STATS_CLASSES && !finlist; i++){
+        if(class_free[i] != arena->stats.class_free[i]) statspb = 1;
     }
 
     //Are all blocks "coherent" ? 
+    //Free blocks have a matching footer, and every block knows if its
+    //previous neighbor is allocated, up to the epilogue
     int coherent = 0;
-    if(start != end){
-        void *current_block = GETNEXTBLOCK(start);
-        while(current_block < end){
-            size_t size = GETSIZE(*(size_t *)current_block);
-            if(size != GETSIZE(*(size_t *)GETFOOTER(current_block))){
-                coherent = 1;
-                break;   
-            }
-            current_block = GETNEXTBLOCK(current_block);
+    current_block = start;
+    prev_type = 1;
+    while(current_block < end){
+        size_t size = GETSIZE(*(size_t *)current_block);
+        if(size < MIN_BLOCK_SIZE || (GETPREVDIRTYBIT(*(size_t *)current_block) != 0) != prev_type){
+            coherent = 1;
+            break;
         }
+        if(!GETDIRTYBIT(*(size_t *)current_block) && *(size_t *)current_block != *(size_t *)GETFOOTER(current_block)){
+            coherent = 1;
+            break;   
+        }
+        prev_type = (int)GETDIRTYBIT(*(size_t *)current_block);
+        current_block = GETNEXTBLOCK(current_block);
     }
+    if(current_block != end || (GETPREVDIRTYBIT(*(size_t *)end) != 0) != prev_type || GETSIZE(*(size_t *)end) != 0)
+        coherent = 1;
+
+    //Are the runs of the slab consistent ?
+    int slabpb = check_slab();
 
-    if(flist || sizepb || coald || finlist || coherent){
+    //Do the quick lists hold allocated blocks of their size ?
+    int quickpb = check_quick() != NULL;
+
+    if(flist || sizepb || bitmappb || linkpb || coald || finlist || coherent || slabpb || statspb || quickpb){
         printf("Test results : \n");
         if(flist) printf("Some elts of the free list aren't free\n");
         if(sizepb) printf("Some free blocks are in the wrong category\n");
+        if(bitmappb) printf("Occupancy bitmap doesn't match the seglist\n");
+        if(linkpb) printf("Some free list links are broken\n");
         if(coald) printf("Some free blocks are not coalesced\n");
         if(finlist) printf("Some free blocks are not in the list\n");
         if(coherent) printf("Incoherent block layout\n");
+        if(slabpb) printf("Some slab runs are inconsistent\n");
+        if(statspb) printf("Statistics counters don't match the heap\n");
+        if(quickpb) printf("Some quick lists are inconsistent\n");
         printf("\n____ENDTEST____\n");
         exit(0);
     }
 }
 
 /*
- * mm_realloc - Standalone implementation for efficiency 
+ * check_class - checks the blocks of a class : returns 1 if some are not free,
+ *     2 if some are in the wrong class, 4 if the links or the order are
+ *     broken. For trees, lo and hi bound the keys of the subtree.
+ */
+int check_class(void *ptr, int index, void *lo, void *hi){
+    int pb = 0;
+#if INSERT_POLICY == LIFO_INSERT
+    void *prev = NULL;
+    while(ptr != NULL){
+        if(GETDIRTYBIT(*(size_t *)ptr)) pb |= 1;
+        if(seglist_index(GETSIZE(*(size_t *)ptr)) != index) pb |= 2;
+        if((void *)GETPREVFREE(ptr) != prev) pb |= 4;
+        prev = ptr;
+        ptr = (void *)GETNEXTFREE(ptr);
+    }
+#else
+    if(ptr == NULL) return 0;
+    if(GETDIRTYBIT(*(size_t *)ptr)) pb |= 1;
+    if(seglist_index(GETSIZE(*(size_t *)ptr)) != index) pb |= 2;
+    if((lo != NULL && block_cmp(lo, ptr) >= 0) || (hi != NULL && block_cmp(ptr, hi) >= 0)) return pb | 4;
+    pb |= check_class(GETLEFT(ptr), index, lo, ptr);
+    pb |= check_class(GETRIGHT(ptr), index, ptr, hi);
+#endif
+    return pb;
+}
+
+/*
+ * check_slab - checks the runs with free slots : they must be in the
+ *     pagemap, in the right class, and their free count must match their map.
+ *     Returns 1 if there is a problem.
+ */
+int check_slab(){
+    int i, j;
+    for(i = 0; i < SLAB_CLASSES; i++){
+        run_t *run = arena->slab_runs[i];
+        run_t *prev = NULL;
+        while(run != NULL){
+            int free_count = 0;
+            for(j = 0; j < RUN_MAP_WORDS; j++) free_count += __builtin_popcount(run->map[j]);
+            if(!slab_owns(arena, run) || run->class_index != i || run->prev != prev) return 1;
+            if(run->free_count == 0 || run->free_count != free_count || run->free_count > run->capacity) return 1;
+            prev = run;
+            run = run->next;
+        }
+    }
+    return 0;
+}
+
+/*
+ * check_quick - checks the quick lists : they hold allocated blocks of the
+ *     heap of their size, as many as the counters say. Returns what is
+ *     wrong with them or NULL.
+ */
+const char *check_quick(){
+    void *start = arena->lo + PROLOGUE_SIZE, *end = GETEPILOGUE();
+    size_t blocks = 0, size = 0;
+    int i;
+    for(i = 0; i < QUICK_CLASSES; i++){
+        void *block;
+        for(block = arena->quick_lists[i]; block != NULL; block = *(void **)(block + SIZE_T_SIZE)){
+            if(block < start || block >= end || (size_t)(block - start) % ALIGNMENT != 0) return "quick block out of the heap";
+            if(!GETDIRTYBIT(*(size_t *)block) || GETSIZE(*(size_t *)block) != MIN_BLOCK_SIZE + (size_t)i * ALIGNMENT)
+                return "quick block of the wrong size";
+            // A cycle would show up as more blocks than the heap can hold
+            if(++blocks > (size_t)(end - start) / MIN_BLOCK_SIZE) return "quick list loops";
+            size += GETSIZE(*(size_t *)block);
+        }
+    }
+    if(blocks != arena->stats.quick_blocks || size != arena->stats.quick_size) return "quick list counters don't match";
+    return NULL;
+}
+
+/*
+ * check_run - checks a run of the slab, returns what is wrong with it or NULL
+ */
+static const char *check_run(run_t *run){
+    int j, free_count = 0;
+    if(!slab_owns(arena, run) || run->class_index >= SLAB_CLASSES) return "run not in the pagemap";
+    for(j = 0; j < RUN_MAP_WORDS; j++) free_count += __builtin_popcount(run->map[j]);
+    if(run->free_count != free_count || run->free_count > run->capacity) return "free count doesn't match the map";
+    //Runs are in the list of their class if and only if they have free slots
+    if(run->free_count == 0 && (run->prev != NULL || run->next != NULL || arena->slab_runs[run->class_index] == run))
+        return "full run in a list";
+    if(run->free_count != 0 && (run->prev == NULL ? arena->slab_runs[run->class_index] != run : run->prev->next != run))
+        return "run missing from its list";
+    if(run->next != NULL && run->next->prev != run) return "broken run links";
+    return NULL;
+}
+
+/*
+ * check_links - tells if the links of a free block agree with its neighbors
+ *     in its class
+ */
+static int check_links(void *block){
+    int index = seglist_index(GETSIZE(*(size_t *)block));
+    void *start = arena->lo + PROLOGUE_SIZE, *end = GETEPILOGUE();
+    void *links[2];
+    int i;
+#if INSERT_POLICY == LIFO_INSERT
+    links[0] = (void *)GETPREVFREE(block);
+    links[1] = (void *)GETNEXTFREE(block);
+    if(links[0] == NULL ? arena->free_seglist[index] != block : (void *)GETNEXTFREE(links[0]) != block) return 0;
+    if(links[1] != NULL && (void *)GETPREVFREE(links[1]) != block) return 0;
+#else
+    links[0] = GETLEFT(block);
+    links[1] = GETRIGHT(block);
+    if((links[0] != NULL && block_cmp(links[0], block) >= 0) || (links[1] != NULL && block_cmp(block, links[1]) >= 0)) return 0;
+#endif
+    for(i = 0; i < 2; i++){
+        if(links[i] == NULL) continue;
+        if(links[i] < start || links[i] >= end || GETDIRTYBIT(*(size_t *)links[i])) return 0;
+        if(seglist_index(GETSIZE(*(size_t *)links[i])) != index) return 0;
+    }
+    return 1;
+}
+
+/*
+ * check_block - checks a block of the heap and what ties it to its
+ *     neighbors, returns what is wrong with it or NULL
+ */
+static const char *check_block(void *block){
+    void *start = arena->lo + PROLOGUE_SIZE, *end = GETEPILOGUE();
+    size_t header = *(size_t *)block;
+    size_t size = GETSIZE(header);
+    if(size < MIN_BLOCK_SIZE || size % ALIGNMENT != 0 || size > (size_t)(end - block)) return "bad size";
+    void *next = block + size;
+    if((GETPREVDIRTYBIT(*(size_t *)next) != 0) != (GETDIRTYBIT(header) != 0)) return "next block has a wrong PREVDIRTYBIT";
+    if(!GETPREVDIRTYBIT(header)){
+        size_t footer = *(size_t *)GETPREVFOOTER(block);
+        if(block == start || GETSIZE(footer) < MIN_BLOCK_SIZE || GETSIZE(footer) > (size_t)(block - start)
+           || *(size_t *)(block - GETSIZE(footer)) != footer || GETDIRTYBIT(footer))
+            return "bad footer of the previous block";
+    }
+    if(!GETDIRTYBIT(header)){
+        if(*(size_t *)GETFOOTER(block) != header) return "footer doesn't match the header";
+        if(!GETPREVDIRTYBIT(header) || !GETDIRTYBIT(*(size_t *)next)) return "free block not coalesced";
+        if(!seglist_contains(block)) return "free block not in its class";
+        if(!check_links(block)) return "broken free links";
+    }
+    return NULL;
+}
+
+/*
+ * check_step - checks the blocks the last operation of the arena touched,
+ *     then CHECK_SWEEP_BLOCKS more blocks of the background sweep. Returns
+ *     the block, or run, that is wrong and prints why, NULL if all is well.
+ */
+void *check_step(){
+    void *start = arena->lo + PROLOGUE_SIZE, *end = GETEPILOGUE();
+    void *bad = NULL;
+    const char *why = NULL;
+    int i;
+
+    //The touched block and its neighbors
+    void *block = arena->touched;
+    if(block != NULL && block >= start && block < end){
+        if((why = check_block(block)) != NULL) bad = block;
+        else {
+            void *next = GETNEXTBLOCK(block);
+            if(!GETPREVDIRTYBIT(*(size_t *)block)){
+                bad = block - GETSIZE(*(size_t *)GETPREVFOOTER(block));
+                why = check_block(bad);
+            }
+            if(why == NULL && next < end) why = check_block(bad = next);
+        }
+    }
+    if(why == NULL && arena->touched_run != NULL) why = check_run(bad = arena->touched_run);
+
+    //The background sweep, going over the heap in address order a few blocks at a time
+    if(arena->sweep == NULL || arena->sweep < start || arena->sweep >= end) arena->sweep = start;
+    for(i = 0; i < CHECK_SWEEP_BLOCKS && why == NULL && arena->sweep < end; i++){
+        if((why = check_block(bad = arena->sweep)) == NULL) arena->sweep = GETNEXTBLOCK(arena->sweep);
+    }
+    if(why == NULL && arena->sweep >= end){
+        //End of a pass : the class bitmaps and the runs with free slots
+        arena->sweep = NULL;
+        bad = arena->seglist_bitmap;
+        for(i = 0; i < NUM_CLASSES && why == NULL; i++){
+            int bit = (arena->seglist_bitmap[1 + i / SL_COUNT] >> (i % SL_COUNT)) & 1;
+            int fl_bit = (arena->seglist_bitmap[0] >> (i / SL_COUNT)) & 1;
+            if(bit != (arena->free_seglist[i] != NULL) || fl_bit != (arena->seglist_bitmap[1 + i / SL_COUNT] != 0))
+                why = "occupancy bitmap doesn't match the seglist";
+        }
+        if(why == NULL && (why = check_quick()) != NULL) bad = arena->quick_lists;
+        for(i = 0; i < SLAB_CLASSES && why == NULL; i++){
+            run_t *run;
+            for(run = arena->slab_runs[i]; run != NULL && why == NULL; run = run->next){
+                bad = run;
+                if(run->class_index != i) why = "run in the list of another class";
+                else why = check_run(run);
+            }
+        }
+    }
+    if(why == NULL) return NULL;
+    printf("mm_check_step: %p : %s\n", bad, why);
+    return bad;
+}
+
+/*
+ * mm_check_step - incremental version of mm_check, cheap enough to run
+ *     after every operation : checks the blocks each arena touched last,
+ *     and sweeps a few more. Returns the wrong block and prints why, or
+ *     returns NULL.
+ */
+void *mm_check_step(){
+    arena_t *current = arena;
+    void *bad = NULL;
+    int i;
+    for(i = 0; i < MM_ARENAS && bad == NULL; i++){
+#if MM_THREADSAFE
+        if(arenas[i].epoch != heap_epoch) continue;
+#endif
+        arena = &arenas[i];
+        if(arena->slab_runs == NULL) continue;
+        LOCK();
+        bad = check_step();
+        UNLOCK();
+    }
+    arena = current;
+    return bad;
+}
+
+/*
+ * mm_realloc - Resize a block. For the heap profiler, this frees the
+ *     block and allocates the new one : the moves of realloc_block,
+ *     through mm_malloc and mm_free, sample nothing on their own.
  */
 void *mm_realloc(void *ptr, size_t newsize) {
+#if MM_PROFILE
+    PROFILE_FREE(ptr);
+    profile_busy++;
+    void *newptr = realloc_block(ptr, newsize);
+    profile_busy--;
+    PROFILE_ALLOC(newptr, newsize);
+    return newptr;
+#else
+    return realloc_block(ptr, newsize);
+#endif
+}
+
+/*
+ * realloc_block - Resize a block, slab objects are moved when they outgrow their class
+ */
+static void *realloc_block(void *ptr, size_t newsize) {
+    arena_t *owner = arena_of(ptr);
+    if(owner == NULL) return large_realloc(ptr, newsize);
+#if MM_THREADSAFE
+    thread_enter();
+    if(owner != arena){
+        // Blocks of other arenas move to ours
+        size_t old_size;
+#if SLAB
+        if(slab_owns(owner, ptr)) old_size = slab_class_size(slab_run(ptr)->class_index);
+        else
+#endif
+        {
+            // The owner may be updating the PREVDIRTYBIT of the header
+            pthread_mutex_lock(&owner->lock);
+            old_size = GETSIZE(*(size_t *)(ptr - SIZE_T_SIZE)) - SIZE_T_SIZE;
+            pthread_mutex_unlock(&owner->lock);
+        }
+        void *newptr = mm_malloc(newsize);
+        if(newptr == NULL) return NULL;
+        memcpy(newptr, ptr, old_size < newsize ? old_size : newsize);
+        remote_free(owner, ptr);
+        return newptr;
+    }
+#endif
+#if SLAB
+    if(slab_owns(arena, ptr)){
+        // Slab objects stay in place while their size is in their class,
+        // so that mm_free_sized finds their class from their size
+        int class_index = slab_run(ptr)->class_index;
+        size_t obj_size = slab_class_size(class_index);
+        if(newsize <= SLAB_MAX && slab_class(newsize) == class_index) return ptr;
+        void *newptr = mm_malloc(newsize);
+        if(newptr == NULL) return NULL;
+        memcpy(newptr, ptr, newsize < obj_size ? newsize : obj_size);
+        mm_free(ptr);
+        return newptr;
+    }
+#endif
+    LOCK();
+    ptr = heap_realloc(ptr, newsize);
+    if(ptr != NULL && !slab_owns(arena, ptr)) arena->touched = ptr - SIZE_T_SIZE;
+    UNLOCK();
+    return ptr;
+}
+
+/*
+ * heap_realloc - Standalone implementation for efficiency 
+ */
+void *heap_realloc(void *ptr, size_t newsize) {
     void *oldptr = ptr;
     void *newptr = oldptr;
 
-    // count the space needed for the header and the footer
-    newsize = ALIGN(newsize + 2 * SIZE_T_SIZE);
-    if(newsize < ALIGN(4* SIZE_T_SIZE)) newsize = ALIGN(4*SIZE_T_SIZE);
+    if(newsize > HEAP_MAX_REQUEST) return NULL;
+    // count the space needed for the header
+    newsize = ALIGN(newsize + SIZE_T_SIZE);
+    if(newsize < MIN_BLOCK_SIZE) newsize = MIN_BLOCK_SIZE;
     // get the size of the block the user asks to expand
     size_t *header = (size_t *) (oldptr - SIZE_T_SIZE);
-    //printf("header contains %d\n", *header);
     size_t current_size = GETSIZE(*header);
+    // size of the data to keep
+    size_t payload_size = current_size - SIZE_T_SIZE;
 #if DEBUG
-    printf("realloc: newsize is %d and current size is %d\n", newsize, current_size);
+    printf("realloc: newsize is %zu and current size is %zu\n", newsize, current_size);
 #endif
     if (newsize > current_size) {
         // we want to expand the size of the current block
-        void *start = mem_heap_lo() + ALIGN(MAXPOW*sizeof(void *));
-        void *end = mem_heap_hi();
-
-        // get the footer of the current block
-        size_t *footer = GETFOOTER((void *) header);
 
         // get the header of the block right next in memory
-        size_t *next_header = (size_t *) ((void *) header + GETSIZE(*header));
+        size_t *next_header = (size_t *) ((void *) header + current_size);
 
-        // get the footer of the previous block in memory
-        size_t *prev_footer = (size_t *) ((void *) header - SIZE_T_SIZE);
+        // get the footer of the previous block in memory, if it is free
+        size_t *prev_footer = (size_t *) GETPREVFOOTER((void *) header);
 
-        int next_header_exists = (void *)next_header <= end;
-        int prev_footer_exists = (void *)prev_footer >= start;
+        // the epilogue is allocated and has a null size
+        int next_is_free = !GETDIRTYBIT(*next_header);
+        int is_last = GETSIZE(*next_header) == 0;
+        int prev_is_free = !GETPREVDIRTYBIT(*header);
+        size_t next_size = next_is_free ? GETSIZE(*next_header) : 0;
+        size_t prev_size = prev_is_free ? GETSIZE(*prev_footer) : 0;
         
-        if(prev_footer_exists && next_header_exists && !GETDIRTYBIT(*next_header) && !GETDIRTYBIT(*prev_footer) && GETSIZE(*next_header) + current_size + GETSIZE(*prev_footer) >= newsize)
+        // A block grown before is likely to grow again : it gets headroom when
+        // it needs no more memory, so that its next reallocs fit in place
+        size_t headroom = GETREALLOCBIT(*header) ? REALLOC_HEADROOM(newsize) : 0;
+
+        if (next_is_free && (next_size + current_size) >= newsize) {
+            // block right next in memory is free
+            // and it is big enough so we can use it to
+            // expand the current block at a minimal cost, without moving it
+            if (newsize + headroom <= next_size + current_size) newsize += headroom;
+            else newsize = next_size + current_size;
+
+            // change the list of free blocks: remove block next to current
+            // that we will use to expand
+            remove_link((void *) next_header);
+            if(arena->sweep == next_header) arena->sweep = header;
+            
+            void *free_block_header = NULL;
+            size_t newheader;
+            if (next_size + current_size - newsize < SPLIT_SIZE) {
+                // no room for appending a free block at the end
+                newheader = (next_size + current_size) | GETPREVDIRTYBIT(*header) | DIRTYBIT | REALLOCBIT;
+                *(size_t *)((void *) header + next_size + current_size) |= PREVDIRTYBIT;
+            } else {
+                // append a free block at then end
+                newheader = newsize | GETPREVDIRTYBIT(*header) | DIRTYBIT | REALLOCBIT;
+
+                free_block_header = ((void *) header + newsize);
+                *(size_t*)free_block_header = (next_size + current_size - newsize) | PREVDIRTYBIT;
+            }
+            // change the header
+            *header = newheader;
+            if (free_block_header != NULL) {
+                mm_coalesce(&free_block_header);
+                add_to_list(free_block_header);
+                arena->stats.splits++;
+            }
+            return newptr;
+        }
+
+        if (is_last || (next_is_free && GETSIZE(*(size_t *)((void *)next_header + next_size)) == 0)){
+            //If this block is the last, or only a free block is after it, we'll
+            //simply extend the heap by the amount needed : the block stays in place
+            if (next_is_free) {
+                remove_link((void *) next_header);
+                if(arena->sweep == next_header) arena->sweep = header;
+            }
+            if(heap_grow(newsize - current_size - next_size) == (void *)-1){
+                if (next_is_free) add_to_list((void *) next_header);
+                return NULL;
+            }
+            //What the extension gave past the block stays free at the end
+            size_t rest = (size_t)(GETEPILOGUE() - (void *)header) - newsize;
+            if (rest >= MIN_BLOCK_SIZE) {
+                void *rest_header = (void *)header + newsize;
+                *(size_t *)rest_header = rest | PREVDIRTYBIT;
+                *(size_t *)GETFOOTER(rest_header) = rest | PREVDIRTYBIT;
+                add_to_list(rest_header);
+            } else newsize += rest;
+            *header = newsize | GETPREVDIRTYBIT(*header) | DIRTYBIT | REALLOCBIT;
+            *(size_t *)GETEPILOGUE() = DIRTYBIT | (rest >= MIN_BLOCK_SIZE ? 0 : PREVDIRTYBIT);
+            return newptr;
+        }
+
+        if(prev_is_free && next_is_free && next_size + current_size + prev_size >= newsize)
         {
             //If we're caught in a sandwich of two blocks, and there's enough space, we'll push this block to the end of the available slot
             //Size of the leftover free space
-            size_t new_free_size = GETSIZE(*next_header) + current_size + GETSIZE(*prev_footer) - newsize;
+            size_t new_free_size = next_size + current_size + prev_size - newsize;
             
             //We remove surrounding free blocks from the free list to use them
             remove_link((void *) next_header);
-            size_t *prev_header = (size_t *) ((void *) prev_footer - GETSIZE(*prev_footer) + SIZE_T_SIZE);
+            size_t *prev_header = (size_t *) ((void *) header - prev_size);
             remove_link((void *) prev_header);
+            if(arena->sweep == header || arena->sweep == next_header) arena->sweep = prev_header;
             
             //Pointer to the new position of the header
             size_t *new_header;
-            if(new_free_size < 4*SIZE_T_SIZE){
+            if(new_free_size < SPLIT_SIZE){
                 
                 //If the free space isn't large enough for a new block, we'll just insert it in the nex block
                 newsize = new_free_size + newsize;
                 //New block will start at the start of the available space
                 new_header = prev_header;
                 //Move the data
-                memmove((void *)new_header + SIZE_T_SIZE, ptr, current_size - SIZE_T_SIZE);
-                //Set the header and footer
-                *new_header = newsize | 1;
-                *(size_t *)GETFOOTER((void *)new_header) = newsize | 1;
+                memmove((void *)new_header + SIZE_T_SIZE, ptr, payload_size);
+                //Set the header
+                *new_header = newsize | GETPREVDIRTYBIT(*prev_header) | DIRTYBIT | REALLOCBIT;
             
             } else {
                 //If the free space is large enough for a free block
                 //New block is put in the highest address possible (optimization for realloc tests)
-                new_header = (size_t *) (((void *)next_header) + GETSIZE(*next_header) - newsize); 
-                memmove((void *)new_header + SIZE_T_SIZE, ptr, current_size - SIZE_T_SIZE);
-                *new_header = newsize | 1;
-                *(size_t *)GETFOOTER((void *)new_header) = newsize | 1;
-                *prev_header = new_free_size & -2;
-                *(size_t *)GETFOOTER((void *)prev_header) = new_free_size & -2;
+                new_header = (size_t *) (((void *)next_header) + next_size - newsize); 
+                memmove((void *)new_header + SIZE_T_SIZE, ptr, payload_size);
+                *new_header = newsize | DIRTYBIT | REALLOCBIT;
+                *prev_header = new_free_size | GETPREVDIRTYBIT(*prev_header);
+                *(size_t *)GETFOOTER((void *)prev_header) = *prev_header;
                 add_to_list((void *)prev_header);
+                arena->stats.splits++;
             }
+            *(size_t *)((void *)new_header + newsize) |= PREVDIRTYBIT;
             return (void *)new_header + SIZE_T_SIZE;   
         }
 
-        if (next_header_exists && !GETDIRTYBIT(*next_header) && (GETSIZE(*next_header) + current_size) >= newsize) {
-            // block right next in memory is free
-            // and it is big enough so we can use it to
-            // expand the current block at a minimal cost
-
-            // change the list of free blocks: remove block next to current
-            // that we will use to expand
-            remove_link((void *) next_header);
-            
-            void *free_block_header = NULL;
-            size_t newheader;
-            if (GETSIZE(*next_header) + current_size - newsize < 4 * SIZE_T_SIZE) {
-                // no room for appending a free block at the end
-                newheader = GETSIZE(*next_header) + current_size | 1;
-            } else {
-                // append a free block at then end
-                newheader = newsize | 1;
-
-                size_t header_tmp = GETSIZE(*next_header) + current_size - newsize;
-                free_block_header = ((void *) header + newsize);
-                *(size_t*)free_block_header = header_tmp;
-                *(size_t*)GETFOOTER(free_block_header) = header_tmp;
-                add_to_list(free_block_header);
-            }
-            // change the header and the footer
-            *header = newheader;
-            *(size_t *) GETFOOTER((void *) header) = newheader;
-            if (free_block_header != NULL) mm_coalesce(&free_block_header);
-            return newptr;
-        }
-        if (prev_footer_exists && !GETDIRTYBIT(*prev_footer) && (GETSIZE(*prev_footer) + current_size) >= newsize) {
+        if (prev_is_free && (prev_size + current_size) >= newsize) {
             // If the previous block is free and large enough to fit the resized block
-            size_t *prev_header = (size_t *) ((void *) prev_footer - GETSIZE(*prev_footer) + SIZE_T_SIZE);
+            size_t *prev_header = (size_t *) ((void *) header - prev_size);
             
             // Remove free link
             remove_link((void *) prev_header);
+            if(arena->sweep == header) arena->sweep = prev_header;
             
             //prepare the new header pointer, and the different sizes
             size_t *new_header;
-            size_t available_size = GETSIZE(*prev_footer) + current_size;
+            size_t available_size = prev_size + current_size;
             size_t new_free_size = available_size - newsize;
             
-            if(new_free_size < 4*SIZE_T_SIZE){
+            if(new_free_size < SPLIT_SIZE){
                 
                 //If we can't create a new free block
                 new_header = prev_header;
-                memmove((void *)new_header + SIZE_T_SIZE, ptr, current_size - SIZE_T_SIZE);
-                *new_header = available_size | 1;
-                *(size_t *)GETFOOTER((void *)new_header) = available_size | 1;
+                size_t prev_dirty = GETPREVDIRTYBIT(*prev_header);
+                memmove((void *)new_header + SIZE_T_SIZE, ptr, payload_size);
+                *new_header = available_size | prev_dirty | DIRTYBIT | REALLOCBIT;
                 return (void *)new_header + SIZE_T_SIZE;
             }
             //If we get here, we have wiggle room. We'll put the resized block at the highest possible address for optimization
             new_header = (size_t *) ((void *)header + current_size - newsize);
-            memmove((void *)new_header + SIZE_T_SIZE, ptr, current_size - SIZE_T_SIZE);
-            *new_header = newsize | 1;
-            *(size_t *)GETFOOTER((void *)new_header) = newsize | 1;
-            *prev_header = new_free_size & -2;
-            *(size_t *)GETFOOTER((void *)prev_header) = new_free_size & -2;
+            memmove((void *)new_header + SIZE_T_SIZE, ptr, payload_size);
+            *new_header = newsize | DIRTYBIT | REALLOCBIT;
+            *prev_header = new_free_size | GETPREVDIRTYBIT(*prev_header);
+            *(size_t *)GETFOOTER((void *)prev_header) = *prev_header;
             add_to_list((void *)prev_header);
+            arena->stats.splits++;
             return (void *)new_header + SIZE_T_SIZE;
         }
     
-        if (!next_header_exists){
-            //If this block is the last, we'll simply extend by the amount needed
-            size_t addition;
-            if(prev_footer_exists && !GETDIRTYBIT(*prev_footer)){
-                
-                // If the previous block is fere, we can use the space
-                size_t *prev_header = (size_t *) ((void *) prev_footer - GETSIZE(*prev_footer) + SIZE_T_SIZE);
-                remove_link((void *) prev_header);
-                header = prev_header;
-                memmove((void *) header + SIZE_T_SIZE, ptr, current_size - SIZE_T_SIZE);
-                addition = newsize - (current_size + GETSIZE(*prev_header));
-            }
-            else addition = newsize - current_size;  
-            if(mem_sbrk(addition) == NULL) return NULL;
-            *header = newsize | 1;
-            footer = GETFOOTER((void *) header);
-            *footer = newsize | 1;
-            return ptr;
-        }
-    
-        //worst case
-        newptr = mm_malloc(newsize);
-        memmove(newptr, oldptr, current_size - 2);
-        mm_free(ptr);
+        //worst case : the block moves, with its headroom
+        newsize += headroom;
+        newptr = alloc_unlocked(newsize - SIZE_T_SIZE);
+        if(newptr == NULL) return NULL;
+        memcpy(newptr, oldptr, payload_size);
+        heap_free(ptr);
+#if SLAB
+        if(newsize - SIZE_T_SIZE > SLAB_MAX)
+#endif
+        *(size_t *)(newptr - SIZE_T_SIZE) |= REALLOCBIT;
         return newptr;
 
     } else {
@@ -598,52 +3249,95 @@ void *mm_realloc(void *ptr, size_t newsize) {
         // and free the right part
 
         // if we have not enough space to create the new free block
-        // then don't actually resize anything
-        if (current_size - newsize > 4 * SIZE_T_SIZE) {
-            size_t newheader = newsize | 1;
-            *header = newheader;
-            size_t *footer = (size_t *) GETFOOTER((void *) header);
-            *footer = newheader;
+        // then don't actually resize anything, and blocks that keep
+        // growing keep their headroom
+        if (GETREALLOCBIT(*header) && newsize + REALLOC_HEADROOM(newsize) >= current_size) return ptr;
+        if (current_size - newsize >= SPLIT_SIZE) {
+            *header = newsize | GETPREVDIRTYBIT(*header) | DIRTYBIT | GETREALLOCBIT(*header);
 
-            newheader = (current_size - newsize);
-            void *free_block_header = (size_t *) ((void *) footer + SIZE_T_SIZE);
-            *(size_t*)free_block_header = newheader;
-            *(size_t *) GETFOOTER( free_block_header) = newheader;
-            add_to_list(free_block_header);
+            void *free_block_header = (void *) header + newsize;
+            *(size_t*)free_block_header = (current_size - newsize) | PREVDIRTYBIT;
             mm_coalesce(&free_block_header);
+            add_to_list(free_block_header);
+            arena->stats.splits++;
         }
 
         return ptr;
     }
 }
 
+/*
+ * log2_floor - index of the highest bit set in x (x must not be 0)
+ */
+static inline int log2_floor(size_t x){
+    return (int)(8 * sizeof(unsigned long)) - 1 - __builtin_clzl((unsigned long)x);
+}
+
 /*
  * seglist_index - returns the index of this size in the free seglist
+ *     Power class 0 holds sizes below 64, class i holds [2^(i+5), 2^(i+6)).
+ *     Each power class is split in SL_COUNT linear sub-classes.
  */
 int seglist_index(size_t size){
-    if(size < 64) return 0;
-    
-    int rsp = 0;
-    while (size){
-        size = size >> 1;
-        rsp += 1;
+    int fl = 0;
+    int shift = 6 - SL_SHIFT;
+    if(size >= 64){
+        fl = log2_floor(size) - 5;
+        if(fl >= MAXPOW) return NUM_CLASSES - 1;
+        shift = fl + 5 - SL_SHIFT;
+    }
+    return fl * SL_COUNT + (int)((size >> shift) & (SL_COUNT - 1));
+}
+
+/*
+ * seglist_search_index - returns the first class whose blocks are all
+ *     at least size bytes large (size is rounded up to the next sub-class)
+ */
+int seglist_search_index(size_t size){
+    if(size >= 64){
+        int shift = log2_floor(size) - SL_SHIFT;
+        size += ((size_t)1 << shift) - 1;
     }
-    if(rsp-6 < MAXPOW) return rsp-6;
-    return MAXPOW-1;   
+    else size += (1 << (6 - SL_SHIFT)) - 1;
+    return seglist_index(size);
+}
+
+/*
+ * seglist_class_size - returns the smallest size held by a class
+ */
+size_t seglist_class_size(int index){
+    int fl = index / SL_COUNT;
+    int sl = index % SL_COUNT;
+    if(fl == 0) return (size_t)sl << (6 - SL_SHIFT);
+    return ((size_t)1 << (fl + 5)) + ((size_t)sl << (fl + 5 - SL_SHIFT));
 }
 
 /*
  * get_optimal_free_block - returns an optimal free block for the requested size
+ *     We first look at a few blocks of the exact class, then use the bitmaps to
+ *     jump to the first non empty class where every block is big enough.
  */
 void *get_optimal_free_block(size_t size){
-    int index = seglist_index(size);
-    while(index < MAXPOW){
-        void *free_list = free_seglist[index];
-        while(free_list != NULL) {
-            if(GETSIZE(*(size_t *)free_list) >= size) return free_list;
-            free_list = (void *)GETNEXTFREE(free_list);
-        }
-        index++;
+    int index;
+#if EXACT_CLASS_PROBES > 0
+    void *free_block = seglist_fit(seglist_index(size), size, EXACT_CLASS_PROBES);
+    if(free_block != NULL) return free_block;
+#endif
+
+    index = seglist_search_index(size);
+    if(index == NUM_CLASSES - 1){
+        //The last class has no upper bound : we have to look at the blocks
+        return seglist_fit(index, size, 1 << 30);
     }
-    return NULL;
+
+    int fl = index / SL_COUNT;
+    unsigned int sl_map = arena->seglist_bitmap[1 + fl] & (~0U << (index % SL_COUNT));
+    if(sl_map == 0){
+        //Nothing left in this power class, look for the next non empty one
+        unsigned int fl_map = (fl + 1 < MAXPOW) ? arena->seglist_bitmap[0] & (~0U << (fl + 1)) : 0;
+        if(fl_map == 0) return NULL;
+        fl = __builtin_ctz(fl_map);
+        sl_map = arena->seglist_bitmap[1 + fl];
+    }
+    return seglist_first(fl * SL_COUNT + __builtin_ctz(sl_map));
 }
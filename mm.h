@@ -4,6 +4,73 @@ extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+extern void mm_free_sized(void *ptr, size_t size);
+extern void *mm_malloc_hinted(size_t size, int flags);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+
+/* Hints of mm_malloc_hinted, about the life of the block */
+#define MM_HINT_SHORT_LIVED 1   /* freed soon : laid out next to the other short-lived blocks */
+#define MM_HINT_LONG_LIVED 2    /* kept for long : no room is kept next to it for others */
+#define MM_HINT_REALLOC 4       /* will grow with mm_realloc : allocated with headroom */
+
+/* Set if the package was built to be called from several threads */
+extern int mm_threadsafe;
+
+/* Number of power of two size classes reported by mm_stats */
+#define MM_STATS_CLASSES 25
+
+/*
+ * Counters of the allocator, filled by mm_stats. Sizes are in bytes and
+ * count block headers. Free class i holds the blocks of [2^(i+5), 2^(i+6)),
+ * the first class everything below 64 and the last everything above.
+ */
+struct mm_stats {
+    size_t heap_size;       /* bytes of the heaps of all arenas */
+    size_t in_use;          /* bytes of allocated heap blocks, slab runs included */
+    size_t blocks_in_use;   /* allocated heap blocks */
+    size_t free_size;       /* bytes of free blocks */
+    size_t free_blocks;     /* free blocks */
+    size_t class_free[MM_STATS_CLASSES];    /* free bytes per class */
+    size_t class_blocks[MM_STATS_CLASSES];  /* free blocks per class */
+    size_t largest_free;    /* size of the largest free block */
+    size_t slab_objects;    /* slab objects handed out, thread caches included */
+    size_t quick_blocks;    /* freed heap blocks waiting to be coalesced (deferred coalescing) */
+    size_t quick_size;      /* bytes of them, not counted in in_use */
+    size_t large_blocks;    /* blocks with a mapping of their own */
+    size_t large_size;      /* bytes mapped for them */
+    unsigned long sbrk_calls;   /* heap extensions and trims */
+    unsigned long splits;       /* free blocks split to serve a request */
+    unsigned long coalesces;    /* free neighbors merged with a freed block */
+};
+extern void mm_stats(struct mm_stats *stats);
+
+/*
+ * Heap profiler : samples about one block per rate bytes allocated and
+ * records its call stack, 0 stops it. mm_profile_dump writes the live and
+ * allocated bytes per call stack in the heap format of pprof.
+ */
+extern void mm_profile_start(size_t rate);
+extern int mm_profile_dump(const char *path);
+
+/*
+ * Snapshot of the state the package keeps out of its heap, to restore
+ * after memlib restored the heap (mem_snapshot, mem_restore). state holds
+ * mm_snapshot_size bytes.
+ */
+extern size_t mm_snapshot_size(void);
+extern void mm_snapshot(void *state);
+extern void mm_restore(const void *state);
+
+/*
+ * Fork handlers, for pthread_atfork : prepare takes every lock of the
+ * package, parent gives them back and child starts them over, free.
+ */
+extern void mm_fork_prepare(void);
+extern void mm_fork_parent(void);
+extern void mm_fork_child(void);
 
 
 /* 
@@ -26,3 +93,4 @@ void add_to_list(void *ptr);
 void *get_optimal_free_block(size_t size);
 int seglist_index(size_t size);
 void mm_check();
+void *mm_check_step();
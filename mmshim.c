@@ -0,0 +1,580 @@
+/*
+ * mmshim.c - Runs the mm package as the allocator of a whole process
+ *
+ * Built into libmm.so (make libmm.so) with the thread-safe package and
+ * memlib, whose heap is then memory of the process :
+ *
+ *     unix> LD_PRELOAD=./libmm.so ls -l
+ *
+ * The shim exports malloc, free, realloc, calloc and the memalign
+ * family. Everything else in the library is hidden, so that its names
+ * don't clash with those of the program.
+ *
+ * With MM_TRACE=<file> in the environment, the requests are also
+ * recorded, and written to <file> in the .rep format when the process
+ * exits, to be replayed with mdriver -f. Each thread records in a buffer
+ * of its own, without locks : a global counter orders the records, and a
+ * full buffer is appended to <file>.raw by its thread. At exit the records
+ * are sorted, and the addresses they return and free are turned into the
+ * ids of the trace, reused once the block is freed.
+ *
+ * With MM_HEAPPROFILE=<file>, the heap profiler of the package samples
+ * about one block per MM_HEAPPROFILE_RATE bytes allocated (512K if unset)
+ * and the profile is written to <file> at exit, for pprof.
+ *
+ * A child of fork gets the heap with its locks free, but is neither traced
+ * nor profiled : <file> stays the parent's.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "trace.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define MAXLINE 1024          /* max string size */
+#define RING_RECORDS 4096     /* records of the buffer of a thread */
+#define REP_FIELD 11          /* width of the .rep header fields, rewritten at the end */
+#define PROFILE_RATE 524288   /* default bytes between heap profile samples */
+#define MAX_REQUEST PTRDIFF_MAX /* larger requests fail with ENOMEM, as in libc */
+
+/* A request, as recorded by the thread that made it */
+typedef struct {
+    unsigned long seq;  /* global order of the request */
+    void *ptr;          /* block returned, or freed */
+    void *old;          /* block given to realloc */
+    size_t size;
+    unsigned int align; /* alignment of a memalign request */
+    unsigned int type;  /* ALLOC, FREE, REALLOC or MEMALIGN */
+} record_t;
+
+/* The records of a thread, on the list of all buffers */
+typedef struct ring {
+    record_t recs[RING_RECORDS];
+    unsigned int count;     /* records not yet written */
+    int in_use;             /* held by a live thread */
+    struct ring *next;
+} ring_t;
+
+static pthread_once_t shim_once = PTHREAD_ONCE_INIT;
+static int shim_ready = 0;
+
+/* Tracing state, see the header comment */
+static int tracing = 0;
+static int trace_fd = -1;
+static char trace_path[MAXLINE];
+static char raw_path[MAXLINE + 4];
+static unsigned long trace_seq = 0;
+static ring_t *rings = NULL;
+static pthread_key_t ring_key;
+
+/* Heap profile written at exit, empty if not profiling */
+static char profile_path[MAXLINE];
+static __thread ring_t *ring;
+
+/*
+ * ring_flush - appends the records of a buffer to the raw file
+ */
+static void ring_flush(ring_t *r)
+{
+    size_t bytes = r->count * sizeof(record_t);
+    char *p = (char *)r->recs;
+    ssize_t done;
+
+    while (bytes > 0 && (done = write(trace_fd, p, bytes)) > 0) {
+	p += done;
+	bytes -= done;
+    }
+    r->count = 0;
+}
+
+/*
+ * ring_release - called when a thread exits : writes its records and
+ *    leaves its buffer to the next thread
+ */
+static void ring_release(void *arg)
+{
+    ring_t *r = arg;
+
+    ring_flush(r);
+    __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * ring_get - returns the buffer of this thread, taking one left by an
+ *    exited thread, or mapping one, on the first request of the thread
+ */
+static ring_t *ring_get(void)
+{
+    ring_t *r;
+    int unused = 0;
+
+    if (ring != NULL)
+	return ring;
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+	unused = 0;
+	if (__atomic_compare_exchange_n(&r->in_use, &unused, 1, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	    break;
+    }
+    if (r == NULL) {
+	r = mmap(NULL, sizeof(ring_t), PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r == MAP_FAILED)
+	    return NULL;
+	r->in_use = 1;
+	r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	    ;
+    }
+    pthread_setspecific(ring_key, r);
+    ring = r;
+    return r;
+}
+
+/*
+ * record - records a request of this thread, seq being its place in the
+ *    order of all requests
+ */
+static void record(unsigned long seq, int type, void *ptr, void *old,
+		   size_t size, size_t align)
+{
+    ring_t *r = ring_get();
+    record_t *rec;
+
+    if (r == NULL)
+	return;
+    rec = &r->recs[r->count];
+    rec->seq = seq;
+    rec->type = type;
+    rec->ptr = ptr;
+    rec->old = old;
+    rec->size = size;
+    rec->align = (unsigned int)align;
+    if (++r->count == RING_RECORDS)
+	ring_flush(r);
+}
+
+/*
+ * next_seq - takes the place of a request in the order of all requests
+ */
+static inline unsigned long next_seq(void)
+{
+    return __atomic_fetch_add(&trace_seq, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * shim_fork_prepare - takes the locks of the package and of memlib before
+ *    a fork, so that none is held in the child by a thread it doesn't have
+ */
+static void shim_fork_prepare(void)
+{
+    mm_fork_prepare();
+    mem_fork_prepare();
+}
+
+/*
+ * shim_fork_parent - gives the locks back in the parent
+ */
+static void shim_fork_parent(void)
+{
+    mem_fork_parent();
+    mm_fork_parent();
+}
+
+/*
+ * shim_fork_child - starts the locks over in the child. The raw file and
+ *    the heap profile are those of the parent : the child records nothing,
+ *    and drops the records of the parent it got in the buffers.
+ */
+static void shim_fork_child(void)
+{
+    ring_t *r;
+
+    mem_fork_child();
+    mm_fork_child();
+    if (tracing) {
+	tracing = 0;
+	for (r = rings; r != NULL; r = r->next)
+	    r->count = 0;
+	close(trace_fd);
+	trace_fd = -1;
+    }
+    profile_path[0] = '\0';
+}
+
+/*
+ * shim_init - sets up the heap on the first request of the process,
+ *    tracing if MM_TRACE is set and heap profiling if MM_HEAPPROFILE is
+ */
+static void shim_init(void)
+{
+    char *path = getenv("MM_TRACE");
+    char *profile = getenv("MM_HEAPPROFILE");
+    char *rate = getenv("MM_HEAPPROFILE_RATE");
+
+    mem_init();
+    if (mm_init() < 0) {
+	fprintf(stderr, "mmshim: mm_init failed\n");
+	abort();
+    }
+    pthread_atfork(shim_fork_prepare, shim_fork_parent, shim_fork_child);
+    if (path != NULL && *path != '\0' && strlen(path) < MAXLINE) {
+	strcpy(trace_path, path);
+	sprintf(raw_path, "%s.raw", path);
+	trace_fd = open(raw_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (trace_fd >= 0 && pthread_key_create(&ring_key, ring_release) == 0)
+	    tracing = 1;
+    }
+    shim_ready = 1;
+    // Started last : backtrace allocates the first time it is called
+    if (profile != NULL && *profile != '\0' && strlen(profile) < MAXLINE) {
+	strcpy(profile_path, profile);
+	mm_profile_start(rate != NULL ? strtoul(rate, NULL, 0) : PROFILE_RATE);
+    }
+}
+
+#define SHIM_INIT() do { if (!shim_ready) pthread_once(&shim_once, shim_init); } while (0)
+
+/*****************************************
+ * The allocation functions of the process
+ ****************************************/
+
+/*
+ * shim_malloc - malloc, under a name of its own for the functions of the
+ *    shim that allocate
+ */
+static void *shim_malloc(size_t size)
+{
+    void *p;
+
+    if (size > MAX_REQUEST) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    SHIM_INIT();
+    // malloc(0) returns a block that can be freed
+    if (size == 0)
+	size = 1;
+    p = mm_malloc(size);
+    if (tracing && p != NULL)
+	record(next_seq(), ALLOC, p, NULL, size, 0);
+    if (p == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+EXPORT void *malloc(size_t size)
+{
+    return shim_malloc(size);
+}
+
+EXPORT void free(void *ptr)
+{
+    if (ptr == NULL)
+	return;
+    SHIM_INIT();
+    // Recorded before the block can be handed out again
+    if (tracing)
+	record(next_seq(), FREE, ptr, NULL, 0, 0);
+    mm_free(ptr);
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    void *p;
+    unsigned long seq = 0;
+
+    if (ptr == NULL)
+	return shim_malloc(size);
+    if (size == 0) {
+	free(ptr);
+	return NULL;
+    }
+    if (size > MAX_REQUEST) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    SHIM_INIT();
+    // Ordered before the old block can be handed out again, as in free
+    if (tracing)
+	seq = next_seq();
+    if ((p = mm_realloc(ptr, size)) == NULL) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    if (tracing)
+	record(seq, REALLOC, p, ptr, size, 0);
+    return p;
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (size != 0 && nmemb > MAX_REQUEST / size) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    SHIM_INIT();
+    // calloc(0) returns a block that can be freed, as malloc(0)
+    if (nmemb == 0 || size == 0)
+	nmemb = size = 1;
+    if ((p = mm_calloc(nmemb, size)) == NULL) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    if (tracing)
+	record(next_seq(), ALLOC, p, NULL, nmemb * size, 0);
+    return p;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) ||
+	alignment % sizeof(void *) != 0)
+	return EINVAL;
+    if (size > MAX_REQUEST)
+	return ENOMEM;
+    SHIM_INIT();
+    if (size == 0)
+	size = 1;
+    if ((p = mm_memalign(alignment, size)) == NULL)
+	return ENOMEM;
+    if (tracing)
+	record(next_seq(), MEMALIGN, p, NULL, size, alignment);
+    *memptr = p;
+    return 0;
+}
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+    void *p = NULL;
+    int err;
+
+    // Smaller alignments than a pointer are always met
+    if (alignment < sizeof(void *))
+	alignment = sizeof(void *);
+    if ((err = posix_memalign(&p, alignment, size)) != 0) {
+	errno = err;
+	return NULL;
+    }
+    return p;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return memalign(mem_pagesize(), size);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+    size_t page = mem_pagesize();
+
+    if (size > MAX_REQUEST) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+/*************************************
+ * Writing the trace at the exit
+ ************************************/
+
+/*
+ * Live blocks of the trace, from address to id : open addressing with
+ * linear probing, removals shift the entries after them back
+ */
+static void **ids_ptr;
+static int *ids_id;
+static size_t ids_cap = 0, ids_count = 0;
+
+static size_t id_slot(void *ptr)
+{
+    size_t i = ((size_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL & (ids_cap - 1);
+
+    while (ids_ptr[i] != NULL && ids_ptr[i] != ptr)
+	i = (i + 1) & (ids_cap - 1);
+    return i;
+}
+
+static int id_find(void *ptr)
+{
+    size_t i;
+
+    if (ids_count == 0)
+	return -1;
+    i = id_slot(ptr);
+    return ids_ptr[i] == NULL ? -1 : ids_id[i];
+}
+
+static void id_remove(void *ptr)
+{
+    size_t i, j, home;
+
+    if (ids_count == 0 || ids_ptr[i = id_slot(ptr)] == NULL)
+	return;
+    ids_ptr[i] = NULL;
+    ids_count--;
+    for (j = (i + 1) & (ids_cap - 1); ids_ptr[j] != NULL; j = (j + 1) & (ids_cap - 1)) {
+	home = ((size_t)ids_ptr[j] >> 4) * 0x9e3779b97f4a7c15ULL & (ids_cap - 1);
+	// Entries whose home is not in (i, j] move back to the hole
+	if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+	    ids_ptr[i] = ids_ptr[j];
+	    ids_id[i] = ids_id[j];
+	    ids_ptr[j] = NULL;
+	    i = j;
+	}
+    }
+}
+
+static int id_insert(void *ptr, int id)
+{
+    void **old_ptr = ids_ptr;
+    int *old_id = ids_id;
+    size_t i, old_cap = ids_cap;
+
+    if (2 * (ids_count + 1) > ids_cap) {
+	ids_cap = ids_cap ? 2 * ids_cap : 1024;
+	ids_ptr = calloc(ids_cap, sizeof(void *));
+	ids_id = malloc(ids_cap * sizeof(int));
+	if (ids_ptr == NULL || ids_id == NULL)
+	    return -1;
+	ids_count = 0;
+	for (i = 0; i < old_cap; i++)
+	    if (old_ptr[i] != NULL)
+		id_insert(old_ptr[i], old_id[i]);
+	free(old_ptr);
+	free(old_id);
+    }
+    i = id_slot(ptr);
+    ids_ptr[i] = ptr;
+    ids_id[i] = id;
+    ids_count++;
+    return 0;
+}
+
+static int cmp_seq(const void *a, const void *b)
+{
+    unsigned long x = ((const record_t *)a)->seq, y = ((const record_t *)b)->seq;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * write_rep_header - writes the header of the .rep at the start of the
+ *    file, with fixed width fields so that it can be rewritten
+ */
+static void write_rep_header(FILE *out, int num_ids, long num_ops)
+{
+    rewind(out);
+    fprintf(out, "%-*d\n%-*d\n%-*ld\n%-*d\n", REP_FIELD, (int)(mem_peaksize() > INT_MAX ? INT_MAX : mem_peaksize()),
+	    REP_FIELD, num_ids, REP_FIELD, num_ops, REP_FIELD, 1);
+}
+
+/*
+ * shim_exit - writes the trace recorded since the start of the process
+ */
+__attribute__((destructor))
+static void shim_exit(void)
+{
+    int *free_ids = NULL, num_free_ids = 0, num_ids = 0, id, old_id;
+    long num_ops = 0, i, n;
+    record_t *recs;
+    struct stat st;
+    ring_t *r;
+    FILE *out;
+
+    if (profile_path[0] != '\0' && mm_profile_dump(profile_path) < 0)
+	fprintf(stderr, "mmshim: could not write %s\n", profile_path);
+    if (!tracing)
+	return;
+    // Later requests are not recorded, threads still running may lose a few
+    tracing = 0;
+    for (r = rings; r != NULL; r = r->next)
+	ring_flush(r);
+    if (fstat(trace_fd, &st) < 0 || (out = fopen(trace_path, "w")) == NULL) {
+	fprintf(stderr, "mmshim: could not write %s\n", trace_path);
+	return;
+    }
+    n = st.st_size / sizeof(record_t);
+    recs = n ? mmap(NULL, n * sizeof(record_t), PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE, trace_fd, 0) : NULL;
+    if (recs == MAP_FAILED || (free_ids = malloc((n + 1) * sizeof(int))) == NULL) {
+	fprintf(stderr, "mmshim: could not read %s\n", raw_path);
+	fclose(out);
+	return;
+    }
+    qsort(recs, n, sizeof(record_t), cmp_seq);
+
+    write_rep_header(out, 0, 0);
+    for (i = 0; i < n; i++) {
+	record_t *rec = &recs[i];
+	int size = rec->size > INT_MAX ? INT_MAX : (int)rec->size;
+
+	if (rec->type == FREE) {
+	    // Blocks allocated before the shim was loaded are not in the trace
+	    if ((id = id_find(rec->ptr)) < 0)
+		continue;
+	    id_remove(rec->ptr);
+	    free_ids[num_free_ids++] = id;
+	    fprintf(out, "f %d\n", id);
+	    num_ops++;
+	    continue;
+	}
+
+	// A realloc of an untraced block starts a new one
+	old_id = rec->type == REALLOC ? id_find(rec->old) : -1;
+	if (old_id >= 0)
+	    id_remove(rec->old);
+
+	// An address seen live again was freed without a record of it
+	if ((id = id_find(rec->ptr)) >= 0) {
+	    id_remove(rec->ptr);
+	    free_ids[num_free_ids++] = id;
+	    fprintf(out, "f %d\n", id);
+	    num_ops++;
+	}
+
+	if (old_id >= 0) {
+	    id = old_id;
+	    fprintf(out, "r %d %d\n", id, size);
+	}
+	else {
+	    id = num_free_ids > 0 ? free_ids[--num_free_ids] : num_ids++;
+	    if (rec->type == MEMALIGN)
+		fprintf(out, "m %d %d %u\n", id, size, rec->align);
+	    else
+		fprintf(out, "a %d %d\n", id, size);
+	}
+	num_ops++;
+	if (id_insert(rec->ptr, id) < 0)
+	    break;
+    }
+    write_rep_header(out, num_ids, num_ops);
+    fclose(out);
+    munmap(recs, n * sizeof(record_t));
+    close(trace_fd);
+    unlink(raw_path);
+}
@@ -0,0 +1,101 @@
+/*
+ * rep2bin.c - Converts a .rep trace file to the binary format of trace.h
+ *
+ * Usage: rep2bin <in.rep> <out>
+ *
+ * The ops are checked while converting, so that mdriver can map binary
+ * traces without looking at them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define MAXLINE 1024 /* max string size */
+
+/* 
+ * app_error - Report an error and exit
+ */
+static void app_error(char *msg, char *path)
+{
+    fprintf(stderr, "rep2bin: %s %s\n", msg, path);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+    trace_header_t header;
+    traceop_t op;
+    char type[MAXLINE];
+    unsigned index, size, align;
+    int num_ops = 0;
+    int max_index = -1;
+
+    if (argc != 3) {
+	fprintf(stderr, "Usage: rep2bin <in.rep> <out>\n");
+	exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL)
+	app_error("could not open", argv[1]);
+    if ((out = fopen(argv[2], "w")) == NULL)
+	app_error("could not create", argv[2]);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.opsize = sizeof(traceop_t);
+    if (fscanf(in, "%d %d %d %d", &header.sugg_heapsize, &header.num_ids,
+	       &header.num_ops, &header.weight) != 4)
+	app_error("bad header in", argv[1]);
+    if (fwrite(&header, sizeof(header), 1, out) != 1)
+	app_error("could not write", argv[2]);
+
+    /* Convert every request line in the trace file */
+    memset(&op, 0, sizeof(op));
+    while (fscanf(in, "%s", type) != EOF) {
+	switch (type[0]) {
+	case 'a':
+	case 'r':
+	    if (fscanf(in, "%u %u", &index, &size) != 2)
+		app_error("bad request in", argv[1]);
+	    op.type = (type[0] == 'a') ? ALLOC : REALLOC;
+	    op.size = size;
+	    op.align = 0;
+	    break;
+	case 'm':
+	    if (fscanf(in, "%u %u %u", &index, &size, &align) != 3)
+		app_error("bad request in", argv[1]);
+	    if (align == 0 || (align & (align - 1)))
+		app_error("alignment not a power of two in", argv[1]);
+	    op.type = MEMALIGN;
+	    op.size = size;
+	    op.align = align;
+	    break;
+	case 'f':
+	    if (fscanf(in, "%u", &index) != 1)
+		app_error("bad request in", argv[1]);
+	    op.type = FREE;
+	    op.size = 0;
+	    op.align = 0;
+	    break;
+	default:
+	    app_error("bogus type character in", argv[1]);
+	}
+	if (index >= (unsigned)header.num_ids)
+	    app_error("request id out of range in", argv[1]);
+	op.index = index;
+	max_index = ((int)index > max_index) ? (int)index : max_index;
+	if (fwrite(&op, sizeof(op), 1, out) != 1)
+	    app_error("could not write", argv[2]);
+	num_ops++;
+    }
+    if (num_ops != header.num_ops || max_index != header.num_ids - 1)
+	app_error("header doesn't match the requests of", argv[1]);
+
+    fclose(in);
+    if (fclose(out) != 0)
+	app_error("could not write", argv[2]);
+    return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * trace.h - Binary trace format, shared by mdriver and rep2bin
+ *
+ * A binary trace is a trace_header_t followed by num_ops traceop_t, in
+ * the byte order of the machine that wrote it. The ops have the same
+ * layout in the file as in memory, so mdriver maps them as they are.
+ */
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#define TRACE_MAGIC   0x50524d4d  /* "MMRP" in a little endian file */
+#define TRACE_VERSION 2
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    enum {ALLOC, FREE, REALLOC, MEMALIGN} type; /* type of request */
+    int index;                        /* index for free() to use later */
+    int size;                         /* byte size of alloc/realloc request */
+    int align;                        /* alignment of a memalign request */
+} traceop_t;
+
+/* Number of request types */
+#define NUM_OP_TYPES 4
+
+/* Fixed header of a binary trace, the ops follow it */
+typedef struct {
+    unsigned int magic;   /* TRACE_MAGIC */
+    unsigned int version; /* TRACE_VERSION */
+    unsigned int opsize;  /* sizeof(traceop_t) of the writer */
+    int sugg_heapsize;    /* suggested heap size (unused) */
+    int num_ids;          /* number of alloc/realloc ids */
+    int num_ops;          /* number of distinct requests */
+    int weight;           /* weight for this trace (unused) */
+    int pad;              /* keeps the ops 8-byte aligned */
+} trace_header_t;
+
+#endif /* __TRACE_H_ */